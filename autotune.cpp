@@ -0,0 +1,171 @@
+//--------------------------------------------------------------------------------------
+// File: autotune.cpp
+//
+// Picks the fastest compiled-in CPU shadow kernel for the current CPU and particle count
+//--------------------------------------------------------------------------------------
+
+#include "autotune.h"
+
+#include <intrin.h>
+#include <share.h>
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+
+// The measurement runs the first receivers against the first 2^bucket casters, so the working set
+// grows with the count range up to AUTOTUNE_MAX_BUCKET. The receivers are scaled down to keep about
+// AUTOTUNE_SAMPLE_PAIRS overlaps per run, but never below the largest tile.
+#define AUTOTUNE_SAMPLE_PAIRS (1u << 18)
+#define AUTOTUNE_MIN_SAMPLE_RECEIVERS 8
+#define AUTOTUNE_MAX_SAMPLE_RECEIVERS 64
+#define AUTOTUNE_REPEATS 3
+
+#define AUTOTUNE_SIGNATURE_SIZE 96
+#define AUTOTUNE_NAME_SIZE 64
+
+static void GetCpuSignature(char (&signature)[AUTOTUNE_SIGNATURE_SIZE])
+{
+	char brand[49] = "unknown";
+
+	int regs[4];
+	__cpuid(regs, 0x80000000);
+	if (unsigned(regs[0]) >= 0x80000004) {
+		for (int leaf = 0; leaf < 3; ++leaf) {
+			__cpuid(regs, 0x80000002 + leaf);
+			memcpy(brand + leaf * sizeof(regs), regs, sizeof(regs));
+		}
+		brand[48] = 0;
+	}
+
+	// The profile is whitespace separated, so the brand string goes in as a single token
+	const char* pBrand = brand;
+	while (*pBrand == ' ') {
+		++pBrand;
+	}
+
+	sprintf_s(signature, "%s/%u", pBrand, std::thread::hardware_concurrency());
+	for (char* p = signature; *p; ++p) {
+		if (*p == ' ') {
+			*p = '_';
+		}
+	}
+}
+
+UINT GetAutotuneBucket(UINT count)
+{
+	UINT bucket = 0;
+	for (; count > 1 && bucket < AUTOTUNE_MAX_BUCKET; count >>= 1) {
+		++bucket;
+	}
+	return bucket;
+}
+
+const ShadowKernelInfo* AutotuneShadowKernel(CpuPrecision precision, const Particle* pProjected, UINT count)
+{
+	// count >= 2^bucket, so the sample is the whole set for small counts
+	const UINT casters = (std::min)(count, 1u << GetAutotuneBucket(count));
+
+	UINT receivers = AUTOTUNE_SAMPLE_PAIRS / (std::max)(casters, 1u);
+	receivers = (std::min)((std::max)(receivers, UINT(AUTOTUNE_MIN_SAMPLE_RECEIVERS)), UINT(AUTOTUNE_MAX_SAMPLE_RECEIVERS));
+	receivers = (std::min)(receivers - receivers % AUTOTUNE_MIN_SAMPLE_RECEIVERS, casters);
+
+	// Only the sample receivers are written, so tuning allocates nothing
+	float shadows[AUTOTUNE_MAX_SAMPLE_RECEIVERS];
+
+	const ShadowKernelInfo* pBest = nullptr;
+	long long bestTime = 0;
+
+	for (UINT i = 0; i < GetShadowKernelCount(); ++i) {
+		const ShadowKernelInfo* pKernel = GetShadowKernel(i);
+		if (pKernel->precision != precision) {
+			continue;
+		}
+
+		long long time = 0;
+		for (int repeat = 0; repeat < AUTOTUNE_REPEATS && receivers > 0; ++repeat) {
+			auto begin = std::chrono::high_resolution_clock::now();
+			pKernel->pFunction(pProjected, casters, 0, receivers, shadows);
+			const long long elapsed = (std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - begin)).count();
+
+			time = repeat == 0 ? elapsed : (std::min)(time, elapsed);
+		}
+
+		if (!pBest || time < bestTime) {
+			pBest = pKernel;
+			bestTime = time;
+		}
+	}
+
+	return pBest;
+}
+
+const ShadowKernelInfo* LoadTunedShadowKernel(LPCSTR pProfilePath, CpuPrecision precision, UINT count)
+{
+	if (!pProfilePath) {
+		return nullptr;
+	}
+
+	// Shared, so that concurrent engines and shard workers can read and append at the same time
+	FILE* pFile = _fsopen(pProfilePath, "r", _SH_DENYNO);
+	if (!pFile) {
+		return nullptr;
+	}
+
+	char cpu[AUTOTUNE_SIGNATURE_SIZE];
+	GetCpuSignature(cpu);
+	const UINT bucket = GetAutotuneBucket(count);
+
+	// <cpu> <precision> <bucket> <kernel>, the last matching line wins
+	const ShadowKernelInfo* pKernel = nullptr;
+	char line[256];
+	while (fgets(line, sizeof(line), pFile)) {
+		char lineCpu[AUTOTUNE_SIGNATURE_SIZE], linePrecision[16], lineKernel[AUTOTUNE_NAME_SIZE];
+		UINT lineBucket = 0;
+
+		if (sscanf_s(line, "%95s %15s %u %63s", lineCpu, UINT(sizeof(lineCpu)), linePrecision, UINT(sizeof(linePrecision)),
+			&lineBucket, lineKernel, UINT(sizeof(lineKernel))) != 4) {
+			continue;
+		}
+
+		if (strcmp(lineCpu, cpu) == 0 && strcmp(linePrecision, GetCpuPrecisionName(precision)) == 0 && lineBucket == bucket) {
+			const ShadowKernelInfo* pFound = FindShadowKernel(lineKernel);
+			if (pFound && pFound->precision == precision) {
+				pKernel = pFound;
+			}
+		}
+	}
+
+	fclose(pFile);
+	return pKernel;
+}
+
+HRESULT SaveTunedShadowKernel(LPCSTR pProfilePath, CpuPrecision precision, UINT count, const ShadowKernelInfo* pKernel)
+{
+	if (!pProfilePath || !pKernel) {
+		return E_INVALIDARG;
+	}
+
+	char cpu[AUTOTUNE_SIGNATURE_SIZE];
+	GetCpuSignature(cpu);
+
+	char line[256];
+	const int length = sprintf_s(line, "%s %s %u %s\n", cpu, GetCpuPrecisionName(precision), GetAutotuneBucket(count), pKernel->pName);
+	if (length <= 0) {
+		return E_FAIL;
+	}
+
+	// The line goes out in a single write on an append-only handle, which the system always positions
+	// at the end of the file, so concurrent runs neither fail to open it nor overwrite each other's lines
+	HANDLE hFile = CreateFileA(pProfilePath, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	DWORD written = 0;
+	const BOOL bWritten = WriteFile(hFile, line, DWORD(length), &written, nullptr);
+	const HRESULT hr = bWritten && written == DWORD(length) ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+	CloseHandle(hFile);
+
+	return hr;
+}
@@ -0,0 +1,29 @@
+//--------------------------------------------------------------------------------------
+// File: autotune.h
+//
+// Picks the fastest compiled-in CPU shadow kernel for the current CPU and particle count
+//
+// Decisions are kept per CPU, precision and power of two range of the particle count in a
+// text profile file, so later runs on the same machine start tuned without measuring.
+// The sample grows with the range, so every decision reflects the cache footprint of its range.
+//--------------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include "cpu_kernels.h"
+
+// Measures every kernel of the precision on a sample of the projected particles
+const ShadowKernelInfo* AutotuneShadowKernel(CpuPrecision precision, const Particle* pProjected, UINT count);
+
+// nullptr if the profile has no decision for this CPU, precision and count range
+const ShadowKernelInfo* LoadTunedShadowKernel(LPCSTR pProfilePath, CpuPrecision precision, UINT count);
+
+HRESULT SaveTunedShadowKernel(LPCSTR pProfilePath, CpuPrecision precision, UINT count, const ShadowKernelInfo* pKernel);
+
+// Power of two range of the particle count decisions are kept for. Counts from 2^AUTOTUNE_MAX_BUCKET
+// up share the last bucket, the sample measured for it is as large as tuning stays affordable.
+UINT GetAutotuneBucket(UINT count);
+
+#define AUTOTUNE_MAX_BUCKET 16
+#define AUTOTUNE_BUCKET_COUNT (AUTOTUNE_MAX_BUCKET + 1)
@@ -1,5 +1,10 @@
+// Defined by the host when the shader is compiled, see CreateComputeShader()
+#ifndef THREAD_X
 #define THREAD_X 32
+#endif
+#ifndef THREAD_Y
 #define THREAD_Y 32
+#endif
 
 struct Particle
 {
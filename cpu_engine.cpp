@@ -0,0 +1,394 @@
+//--------------------------------------------------------------------------------------
+// File: cpu_engine.cpp
+//
+// CPU evaluation of particle self shadowing
+//--------------------------------------------------------------------------------------
+
+#include "cpu_engine.h"
+#include "autotune.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+void ProjectParticles(const float dir[4], const Particle* pParticles, UINT count, Particle* pProjectedOut)
+{
+	// sunZ = normalize(cross(sunDir, Y)), sunY = cross(sunZ, sunDir), the same way compute.hlsl does it
+	const float revLen = 1.0f / sqrtf(dir[2] * dir[2] + dir[0] * dir[0]); // Suppose the sunDir and Y are not collinear
+	const Pos sunZ{ -dir[2] * revLen, 0.0f, dir[0] * revLen };
+	const Pos sunY{ -sunZ.z * dir[1], sunZ.z * dir[0] - sunZ.x * dir[2], sunZ.x * dir[1] };
+
+	for (UINT i = 0; i < count; ++i) {
+		const Pos& p = pParticles[i].pos;
+
+		pProjectedOut[i].pos.x = dir[0] * p.x + dir[1] * p.y + dir[2] * p.z;
+		pProjectedOut[i].pos.y = sunY.x * p.x + sunY.y * p.y + sunY.z * p.z;
+		pProjectedOut[i].pos.z = sunZ.x * p.x + sunZ.y * p.y + sunZ.z * p.z;
+		pProjectedOut[i].radius = pParticles[i].radius;
+		pProjectedOut[i].opacity = pParticles[i].opacity;
+	}
+}
+
+float OverlapProjected(const Particle& caster, const Particle& receiver)
+{
+	if (!(caster.pos.x > receiver.pos.x)) {
+		return 0.0f;
+	}
+
+	const float dy = receiver.pos.y - caster.pos.y;
+	const float dz = receiver.pos.z - caster.pos.z;
+	const float dist = sqrtf(dy * dy + dz * dz);
+
+	return caster.opacity * (std::min)(caster.radius * caster.radius / (receiver.radius * receiver.radius), 1.0f) *
+		Smoothstep(receiver.radius + caster.radius, fabsf(receiver.radius - caster.radius), dist);
+}
+
+//--------------------------------------------------------------------------------------
+// Engine
+//--------------------------------------------------------------------------------------
+
+enum CpuEnginePhase {
+	CPU_ENGINE_REPLICATE,
+	CPU_ENGINE_COMPUTE,
+};
+
+struct CpuEngineJob {
+	CpuEnginePhase phase;
+	const Particle* pProjected;
+	UINT count;
+	UINT first;
+	UINT last;
+	float* pShadows;
+	ShadowKernelFn pKernel;
+};
+
+struct CpuEngineNode {
+	USHORT nodeNumber;
+	GROUP_AFFINITY affinity;
+	UINT numProcessors;
+	UINT numThreads;
+
+	// Copy of the projected particles in the node memory, nullptr if the workers read the caller's array
+	Particle* pReplica;
+	UINT replicaCapacity;
+};
+
+struct CpuEngine {
+	bool bPinned;
+	CpuPrecision precision;
+	char profilePath[MAX_PATH];
+	const ShadowKernelInfo* pKernels[AUTOTUNE_BUCKET_COUNT];
+
+	std::vector<CpuEngineNode> nodes;
+	std::vector<std::thread> threads;
+
+	std::mutex mutex;
+	std::condition_variable cvStart;
+	std::condition_variable cvDone;
+	ULONGLONG generation;
+	UINT pending;
+	bool bQuit;
+	CpuEngineJob job;
+};
+
+static UINT CountAffinityBits(KAFFINITY mask)
+{
+	UINT count = 0;
+	for (; mask; mask &= mask - 1) {
+		++count;
+	}
+	return count;
+}
+
+static void DetectNumaNodes(std::vector<CpuEngineNode>* pNodes)
+{
+	ULONG highestNode = 0;
+	if (!GetNumaHighestNodeNumber(&highestNode)) {
+		return;
+	}
+
+	for (ULONG node = 0; node <= highestNode; ++node) {
+		CpuEngineNode desc = {};
+		desc.nodeNumber = USHORT(node);
+		if (!GetNumaNodeProcessorMaskEx(USHORT(node), &desc.affinity)) {
+			continue;
+		}
+
+		desc.numProcessors = CountAffinityBits(desc.affinity.Mask);
+		if (desc.numProcessors > 0) {
+			pNodes->push_back(desc);
+		}
+	}
+}
+
+// Splits [first, last) into parts proportional to the weights, so that every part is contiguous
+static void GetWeightedRange(UINT first, UINT last, UINT weightBefore, UINT weight, UINT totalWeight, UINT* pFirst, UINT* pLast)
+{
+	const ULONGLONG total = last - first;
+	*pFirst = first + UINT(total * weightBefore / totalWeight);
+	*pLast = first + UINT(total * (weightBefore + weight) / totalWeight);
+}
+
+static void ReleaseReplica(CpuEngineNode* pNode)
+{
+	if (pNode->pReplica) {
+		VirtualFree(pNode->pReplica, 0, MEM_RELEASE);
+	}
+	pNode->pReplica = nullptr;
+	pNode->replicaCapacity = 0;
+}
+
+static HRESULT ReserveReplicas(CpuEngine* pEngine, UINT count)
+{
+	// A single node reads the caller's array directly, there is nothing to be local to
+	if (pEngine->nodes.size() < 2) {
+		return S_OK;
+	}
+
+	for (auto& node : pEngine->nodes) {
+		if (node.replicaCapacity >= count) {
+			continue;
+		}
+
+		ReleaseReplica(&node);
+
+		// The pages are committed on the node and first touched by the node's own workers
+		node.pReplica = static_cast<Particle*>(VirtualAllocExNuma(GetCurrentProcess(), nullptr, SIZE_T(count) * sizeof(Particle),
+			MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node.nodeNumber));
+		if (!node.pReplica) {
+			return E_OUTOFMEMORY;
+		}
+		node.replicaCapacity = count;
+	}
+
+	return S_OK;
+}
+
+static void RunWorkerJob(CpuEngine* pEngine, const CpuEngineJob& job, UINT nodeIndex, UINT indexInNode)
+{
+	const CpuEngineNode& node = pEngine->nodes[nodeIndex];
+
+	if (job.phase == CPU_ENGINE_REPLICATE) {
+		if (node.pReplica) {
+			UINT begin, end;
+			GetWeightedRange(0, job.count, indexInNode, 1, node.numThreads, &begin, &end);
+			memcpy(node.pReplica + begin, job.pProjected + begin, SIZE_T(end - begin) * sizeof(Particle));
+		}
+		return;
+	}
+
+	UINT threadsBefore = 0;
+	for (UINT i = 0; i < nodeIndex; ++i) {
+		threadsBefore += pEngine->nodes[i].numThreads;
+	}
+
+	UINT begin, end;
+	GetWeightedRange(job.first, job.last, threadsBefore + indexInNode, 1, UINT(pEngine->threads.size()), &begin, &end);
+
+	job.pKernel(node.pReplica ? node.pReplica : job.pProjected, job.count, begin, end, job.pShadows);
+}
+
+static void CpuEngineWorkerMain(CpuEngine* pEngine, UINT nodeIndex, UINT indexInNode)
+{
+	if (pEngine->bPinned) {
+		SetThreadGroupAffinity(GetCurrentThread(), &pEngine->nodes[nodeIndex].affinity, nullptr);
+	}
+
+	ULONGLONG generation = 0;
+	for (;;) {
+		CpuEngineJob job;
+		{
+			std::unique_lock<std::mutex> lock(pEngine->mutex);
+			pEngine->cvStart.wait(lock, [&] { return pEngine->bQuit || pEngine->generation != generation; });
+			if (pEngine->bQuit) {
+				return;
+			}
+			generation = pEngine->generation;
+			job = pEngine->job;
+		}
+
+		RunWorkerJob(pEngine, job, nodeIndex, indexInNode);
+
+		std::lock_guard<std::mutex> lock(pEngine->mutex);
+		if (--pEngine->pending == 0) {
+			pEngine->cvDone.notify_one();
+		}
+	}
+}
+
+static void DispatchJob(CpuEngine* pEngine, const CpuEngineJob& job)
+{
+	std::unique_lock<std::mutex> lock(pEngine->mutex);
+	pEngine->job = job;
+	pEngine->pending = UINT(pEngine->threads.size());
+	++pEngine->generation;
+	pEngine->cvStart.notify_all();
+	pEngine->cvDone.wait(lock, [&] { return pEngine->pending == 0; });
+}
+
+HRESULT CreateCpuEngine(const CpuEngineDesc* pDesc, CpuEngine** ppEngineOut)
+{
+	if (!pDesc || !ppEngineOut || pDesc->precision >= CPU_PRECISION_COUNT ||
+		(pDesc->pProfilePath && strlen(pDesc->pProfilePath) >= MAX_PATH)) {
+		return E_INVALIDARG;
+	}
+	*ppEngineOut = nullptr;
+
+	CpuEngine* pEngine = new CpuEngine();
+	pEngine->generation = 0;
+	pEngine->pending = 0;
+	pEngine->bQuit = false;
+	pEngine->precision = pDesc->precision;
+	pEngine->profilePath[0] = 0;
+	if (pDesc->pProfilePath) {
+		strcpy_s(pEngine->profilePath, pDesc->pProfilePath);
+	}
+	for (auto& pKernel : pEngine->pKernels) {
+		pKernel = nullptr;
+	}
+
+	if (pDesc->bNumaAware) {
+		DetectNumaNodes(&pEngine->nodes);
+	}
+	pEngine->bPinned = !pEngine->nodes.empty();
+
+	if (pEngine->nodes.empty()) {
+		CpuEngineNode node = {};
+		node.numProcessors = (std::max)(std::thread::hardware_concurrency(), 1u);
+		pEngine->nodes.push_back(node);
+	}
+
+	UINT totalProcessors = 0;
+	for (const auto& node : pEngine->nodes) {
+		totalProcessors += node.numProcessors;
+	}
+
+	// Threads are spread over the nodes proportionally to their processors. With fewer threads than
+	// nodes some nodes get none, they are dropped so the engine never runs more threads than requested.
+	const UINT numThreads = pDesc->numThreads ? pDesc->numThreads : totalProcessors;
+	UINT processorsBefore = 0;
+	for (auto& node : pEngine->nodes) {
+		UINT begin, end;
+		GetWeightedRange(0, numThreads, processorsBefore, node.numProcessors, totalProcessors, &begin, &end);
+		node.numThreads = end - begin;
+		processorsBefore += node.numProcessors;
+	}
+	pEngine->nodes.erase(std::remove_if(pEngine->nodes.begin(), pEngine->nodes.end(),
+		[](const CpuEngineNode& node) { return node.numThreads == 0; }), pEngine->nodes.end());
+
+	HRESULT hr = ReserveReplicas(pEngine, pDesc->maxParticles);
+	if (FAILED(hr)) {
+		ReleaseCpuEngine(pEngine);
+		return hr;
+	}
+
+	for (UINT nodeIndex = 0; nodeIndex < pEngine->nodes.size(); ++nodeIndex) {
+		for (UINT i = 0; i < pEngine->nodes[nodeIndex].numThreads; ++i) {
+			pEngine->threads.emplace_back(CpuEngineWorkerMain, pEngine, nodeIndex, i);
+		}
+	}
+
+	*ppEngineOut = pEngine;
+	return S_OK;
+}
+
+void ReleaseCpuEngine(CpuEngine* pEngine)
+{
+	if (!pEngine) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(pEngine->mutex);
+		pEngine->bQuit = true;
+	}
+	pEngine->cvStart.notify_all();
+
+	for (auto& thread : pEngine->threads) {
+		thread.join();
+	}
+
+	for (auto& node : pEngine->nodes) {
+		ReleaseReplica(&node);
+	}
+
+	delete pEngine;
+}
+
+UINT GetCpuEngineNodeCount(const CpuEngine* pEngine)
+{
+	return pEngine->bPinned ? UINT(pEngine->nodes.size()) : 1;
+}
+
+UINT GetCpuEngineThreadCount(const CpuEngine* pEngine)
+{
+	return UINT(pEngine->threads.size());
+}
+
+// Kernel for the count range: the one already picked by this engine, then the one from the profile,
+// then a freshly measured one which is saved to the profile
+static ShadowKernelFn SelectKernel(CpuEngine* pEngine, const Particle* pProjected, UINT count)
+{
+	const LPCSTR pProfilePath = pEngine->profilePath[0] ? pEngine->profilePath : nullptr;
+	const ShadowKernelInfo*& pKernel = pEngine->pKernels[GetAutotuneBucket(count)];
+
+	if (!pKernel) {
+		pKernel = LoadTunedShadowKernel(pProfilePath, pEngine->precision, count);
+	}
+
+	if (!pKernel) {
+		pKernel = AutotuneShadowKernel(pEngine->precision, pProjected, count);
+		if (pProfilePath) {
+			SaveTunedShadowKernel(pProfilePath, pEngine->precision, count, pKernel);
+		}
+	}
+
+	return pKernel->pFunction;
+}
+
+HRESULT RunCpuEngine(CpuEngine* pEngine, const Particle* pProjected, UINT count, UINT first, UINT last, float* pShadowsOut)
+{
+	if (!pEngine || !pProjected || !pShadowsOut || first > last || last > count) {
+		return E_INVALIDARG;
+	}
+
+	HRESULT hr = ReserveReplicas(pEngine, count);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	CpuEngineJob job = { CPU_ENGINE_REPLICATE, pProjected, count, first, last, pShadowsOut, SelectKernel(pEngine, pProjected, count) };
+	if (pEngine->nodes.size() > 1) {
+		DispatchJob(pEngine, job);
+	}
+
+	job.phase = CPU_ENGINE_COMPUTE;
+	DispatchJob(pEngine, job);
+
+	return S_OK;
+}
+
+HRESULT ComputeShadowsCPU(const Particle* pProjected, UINT count, UINT first, UINT last, float* pShadowsOut, UINT numThreads)
+{
+	CpuEngineDesc desc = {};
+	desc.numThreads = numThreads;
+	desc.bNumaAware = true;
+	desc.maxParticles = count;
+	desc.precision = CPU_PRECISION_EXACT;
+	desc.pProfilePath = CPU_ENGINE_DEFAULT_PROFILE;
+
+	CpuEngine* pEngine = nullptr;
+	HRESULT hr = CreateCpuEngine(&desc, &pEngine);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	hr = RunCpuEngine(pEngine, pProjected, count, first, last, pShadowsOut);
+	ReleaseCpuEngine(pEngine);
+
+	return hr;
+}
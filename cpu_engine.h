@@ -0,0 +1,58 @@
+//--------------------------------------------------------------------------------------
+// File: cpu_engine.h
+//
+// CPU evaluation of particle self shadowing
+//--------------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include "particles.h"
+#include "cpu_kernels.h"
+
+// Profile the one-shot ComputeShadowsCPU() keeps its kernel decisions in
+#define CPU_ENGINE_DEFAULT_PROFILE "cpu_kernels.profile"
+
+// Rotates particles into the sun basis used by compute.hlsl:
+// X - distance along sunDir, Y and Z - position in the plane orthogonal to sunDir
+void ProjectParticles(const float dir[4], const Particle* pParticles, UINT count, Particle* pProjectedOut);
+
+// Same as Overlap() in main.cpp but for particles already passed through ProjectParticles()
+float OverlapProjected(const Particle& caster, const Particle& receiver);
+
+struct CpuEngineDesc {
+	// 0 - all the hardware threads
+	UINT numThreads;
+
+	// Detects NUMA nodes, pins the workers to them, replicates the projected particles in the
+	// memory of every node and gives every node its own receiver range.
+	// If false the workers are not pinned and all of them read the caller's particles.
+	bool bNumaAware;
+
+	// Particle count the node replicas are preallocated for, they grow on demand if exceeded
+	UINT maxParticles;
+
+	// The kernel is autotuned among the kernels of this precision at the first run for every count range
+	CpuPrecision precision;
+
+	// Profile file the autotune decisions are loaded from and saved to, nullptr to tune every engine anew
+	LPCSTR pProfilePath;
+};
+
+// Persistent pool of worker threads. An engine runs one job at a time.
+struct CpuEngine;
+
+HRESULT CreateCpuEngine(const CpuEngineDesc* pDesc, CpuEngine** ppEngineOut);
+void ReleaseCpuEngine(CpuEngine* pEngine);
+
+// Number of NUMA nodes the engine schedules over, 1 if it is not NUMA aware
+UINT GetCpuEngineNodeCount(const CpuEngine* pEngine);
+UINT GetCpuEngineThreadCount(const CpuEngine* pEngine);
+
+// Computes shadows of receivers [first, last) cast by all the other particles.
+// pShadowsOut is indexed by particle, so only [first, last) of it is written.
+// The result does not depend on the number of threads or nodes, nor for CPU_PRECISION_EXACT on the kernel picked.
+HRESULT RunCpuEngine(CpuEngine* pEngine, const Particle* pProjected, UINT count, UINT first, UINT last, float* pShadowsOut);
+
+// One-shot helper: creates a NUMA aware CPU_PRECISION_EXACT engine tuned with CPU_ENGINE_DEFAULT_PROFILE, runs it and releases it
+HRESULT ComputeShadowsCPU(const Particle* pProjected, UINT count, UINT first, UINT last, float* pShadowsOut, UINT numThreads);
@@ -0,0 +1,192 @@
+//--------------------------------------------------------------------------------------
+// File: cpu_kernels.cpp
+//
+// Compile-time specialized CPU shadow kernels
+//--------------------------------------------------------------------------------------
+
+#include "cpu_kernels.h"
+
+#include <math.h>
+#include <string.h>
+
+// Culling only skips casters whose overlap is exactly zero, the margin covers the rounding
+// of the squared distance compared to sqrtf() in the overlap itself
+#define CULLING_MARGIN 1.0001f
+
+// Below this reach its square is denormal or zero and the margin no longer covers the rounding
+#define CULLING_MIN_REACH 1e-18f
+
+template <CpuPrecision Precision>
+struct ShadowAccum {
+	typedef float Type;
+};
+
+template <>
+struct ShadowAccum<CPU_PRECISION_HIGH> {
+	typedef double Type;
+};
+
+struct ShadowReceiver {
+	float x, y, z;
+	float radius;
+	float radius2;
+	float invRadius2;
+};
+
+// Branch free OverlapProjected(). For CPU_PRECISION_EXACT and CPU_PRECISION_HIGH it evaluates the same
+// expression in the same order. Non casters are selected out rather than multiplied by zero, because
+// with a zero radius the expression is NaN, which the reference never evaluates for them.
+template <CpuPrecision Precision>
+static inline float LaneOverlap(const Particle& caster, const ShadowReceiver& receiver)
+{
+	const bool bCaster = caster.pos.x > receiver.x;
+
+	const float dy = receiver.y - caster.pos.y;
+	const float dz = receiver.z - caster.pos.z;
+	const float dist = sqrtf(dy * dy + dz * dz);
+
+	const float edge0 = receiver.radius + caster.radius;
+	const float edge1 = fabsf(receiver.radius - caster.radius);
+
+	if (Precision == CPU_PRECISION_FAST) {
+		const float t = (std::min)((std::max)((dist - edge0) / (edge1 - edge0), 0.0f), 1.0f);
+		const float overlap = caster.opacity * (std::min)(caster.radius * caster.radius * receiver.invRadius2, 1.0f) * (t * t * (3.0f - 2.0f * t));
+		return bCaster ? overlap : 0.0f;
+	}
+
+	const float overlap = caster.opacity * (std::min)(caster.radius * caster.radius / receiver.radius2, 1.0f) * Smoothstep(edge0, edge1, dist);
+	return bCaster ? overlap : 0.0f;
+}
+
+template <UINT SimdWidth>
+static inline bool BlockReaches(const Particle* pBlock, const ShadowReceiver& receiver)
+{
+	bool bReaches = false;
+
+	for (UINT l = 0; l < SimdWidth; ++l) {
+		const float dy = receiver.y - pBlock[l].pos.y;
+		const float dz = receiver.z - pBlock[l].pos.z;
+		const float reach = receiver.radius + pBlock[l].radius;
+
+		// Beyond the reach the smoothstep is zero only if edge0 > edge1: with a zero radius both edges
+		// are equal and the smoothstep is one there, so such casters are never culled
+		const bool bCullable = reach > fabsf(receiver.radius - pBlock[l].radius) && reach >= CULLING_MIN_REACH &&
+			dy * dy + dz * dz >= reach * reach * CULLING_MARGIN;
+
+		bReaches |= (pBlock[l].pos.x > receiver.x) & !bCullable;
+	}
+
+	return bReaches;
+}
+
+template <UINT TileRows, UINT SimdWidth, bool bCulling, CpuPrecision Precision>
+static void ShadowKernel(const Particle* pCasters, UINT count, UINT first, UINT last, float* pShadowsOut)
+{
+	typedef typename ShadowAccum<Precision>::Type Accum;
+
+	UINT i = first;
+	for (; i + TileRows <= last; i += TileRows) {
+		ShadowReceiver receivers[TileRows];
+		Accum result[TileRows];
+
+		for (UINT r = 0; r < TileRows; ++r) {
+			const Particle& p = pCasters[i + r];
+			receivers[r] = { p.pos.x, p.pos.y, p.pos.z, p.radius, p.radius * p.radius, 1.0f / (p.radius * p.radius) };
+			result[r] = 1.0f;
+		}
+
+		// The terms are always multiplied in caster order, so the result does not depend on the specialization
+		UINT j = 0;
+		for (; j + SimdWidth <= count; j += SimdWidth) {
+			const Particle* pBlock = pCasters + j;
+
+			for (UINT r = 0; r < TileRows; ++r) {
+				if (bCulling && !BlockReaches<SimdWidth>(pBlock, receivers[r])) {
+					continue;
+				}
+
+				float factors[SimdWidth];
+				for (UINT l = 0; l < SimdWidth; ++l) {
+					factors[l] = 1.0f - LaneOverlap<Precision>(pBlock[l], receivers[r]);
+				}
+
+				// The reference skips the receiver itself, multiplying by one instead is exact
+				if (i + r - j < SimdWidth) {
+					factors[i + r - j] = 1.0f;
+				}
+				for (UINT l = 0; l < SimdWidth; ++l) {
+					result[r] *= factors[l];
+				}
+			}
+		}
+
+		for (; j < count; ++j) {
+			for (UINT r = 0; r < TileRows; ++r) {
+				if (j != i + r) {
+					result[r] *= 1.0f - LaneOverlap<Precision>(pCasters[j], receivers[r]);
+				}
+			}
+		}
+
+		for (UINT r = 0; r < TileRows; ++r) {
+			pShadowsOut[i + r] = float(result[r]);
+		}
+	}
+
+	if (TileRows > 1 && i < last) {
+		ShadowKernel<1, SimdWidth, bCulling, Precision>(pCasters, count, i, last, pShadowsOut);
+	}
+}
+
+#define SHADOW_KERNEL(precision, tile, width, culling) \
+	{ #precision "_t" #tile "_w" #width "_c" #culling, CPU_PRECISION_##precision, tile, width, culling != 0, \
+	  ShadowKernel<tile, width, culling != 0, CPU_PRECISION_##precision> }
+
+#define SHADOW_KERNELS_WIDTH(precision, tile, width) \
+	SHADOW_KERNEL(precision, tile, width, 0), SHADOW_KERNEL(precision, tile, width, 1)
+
+#define SHADOW_KERNELS_TILE(precision, tile) \
+	SHADOW_KERNELS_WIDTH(precision, tile, 4), SHADOW_KERNELS_WIDTH(precision, tile, 8), SHADOW_KERNELS_WIDTH(precision, tile, 16)
+
+#define SHADOW_KERNELS(precision) \
+	SHADOW_KERNELS_TILE(precision, 1), SHADOW_KERNELS_TILE(precision, 4), SHADOW_KERNELS_TILE(precision, 8)
+
+static const ShadowKernelInfo g_shadowKernels[] = {
+	SHADOW_KERNELS(EXACT),
+	SHADOW_KERNELS(FAST),
+	SHADOW_KERNELS(HIGH),
+};
+
+UINT GetShadowKernelCount()
+{
+	return UINT(sizeof(g_shadowKernels) / sizeof(g_shadowKernels[0]));
+}
+
+const ShadowKernelInfo* GetShadowKernel(UINT index)
+{
+	return index < GetShadowKernelCount() ? &g_shadowKernels[index] : nullptr;
+}
+
+const ShadowKernelInfo* FindShadowKernel(const char* pName)
+{
+	for (const auto& kernel : g_shadowKernels) {
+		if (strcmp(kernel.pName, pName) == 0) {
+			return &kernel;
+		}
+	}
+	return nullptr;
+}
+
+const char* GetCpuPrecisionName(CpuPrecision precision)
+{
+	switch (precision) {
+	case CPU_PRECISION_EXACT:
+		return "EXACT";
+	case CPU_PRECISION_FAST:
+		return "FAST";
+	case CPU_PRECISION_HIGH:
+		return "HIGH";
+	default:
+		return "UNKNOWN";
+	}
+}
@@ -0,0 +1,42 @@
+//--------------------------------------------------------------------------------------
+// File: cpu_kernels.h
+//
+// Compile-time specialized CPU shadow kernels
+//--------------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include "particles.h"
+
+enum CpuPrecision {
+	// Bitwise equal to the product of OverlapProjected() terms over the other particles, whatever the tile size,
+	// SIMD width or culling, zero radii included
+	CPU_PRECISION_EXACT,
+	// Float math without the double precision smoothstep, close to but not bitwise equal to OverlapProjected()
+	CPU_PRECISION_FAST,
+	// Same terms as CPU_PRECISION_EXACT accumulated in double
+	CPU_PRECISION_HIGH,
+
+	CPU_PRECISION_COUNT
+};
+
+// Computes shadows of receivers [first, last) cast by all count projected particles, pShadowsOut is indexed by particle
+typedef void (*ShadowKernelFn)(const Particle* pCasters, UINT count, UINT first, UINT last, float* pShadowsOut);
+
+struct ShadowKernelInfo {
+	const char* pName;
+	CpuPrecision precision;
+	UINT tileRows;		// receivers kept in registers against every caster block
+	UINT simdWidth;		// casters evaluated per block
+	bool bCulling;		// skips blocks that cannot overlap any receiver of the tile
+	ShadowKernelFn pFunction;
+};
+
+UINT GetShadowKernelCount();
+const ShadowKernelInfo* GetShadowKernel(UINT index);
+
+// nullptr if no kernel with the name is compiled in
+const ShadowKernelInfo* FindShadowKernel(const char* pName);
+
+const char* GetCpuPrecisionName(CpuPrecision precision);
@@ -15,6 +15,13 @@
 #include <array>
 #include <assert.h>
 #include <chrono>
+#include <thread>
+#include <vector>
+#include "particles.h"
+#include "cpu_engine.h"
+#include "shards.h"
+#include "scene_generator.h"
+#include "shadows_api.h"
 
 #ifndef SAFE_RELEASE
 #define SAFE_RELEASE(p)      { if (p) { (p)->Release(); (p)=nullptr; } }
@@ -29,6 +36,28 @@
 // The number of elements in a buffer to be tested
 const UINT NUM_ELEMENTS = 1024;
 
+// Number of worker processes for the sharded CPU evaluation check, comment out to skip it
+#define SHARD_COUNT 4
+// A shard worker running longer is considered hung, terminated and restarted
+#define SHARD_TIMEOUT_MS 5000
+
+// Comment out the following line to skip the NUMA aware vs naive CPU engine benchmark
+#define BENCHMARK_CPU_ENGINE
+
+// The number of particles the CPU engine benchmark runs on
+const UINT NUM_BENCHMARK_ELEMENTS = 32768;
+// Timed runs per engine, the fastest one is reported
+const int NUM_BENCHMARK_REPEATS = 5;
+
+// Comment out the following line to skip the scene generator benchmark
+#define BENCHMARK_SCENE_GENERATOR
+
+// The number of particles the scene generator benchmark generates
+const UINT NUM_GENERATED_ELEMENTS = 10000000;
+
+// Seed of all the generated scenes, the same seed gives the same particles on every machine
+const ULONGLONG SCENE_SEED = 42;
+
 
 //--------------------------------------------------------------------------------------
 // Forward declarations 
@@ -62,32 +91,12 @@ ID3D11Device*               g_pDevice = nullptr;
 ID3D11DeviceContext*        g_pContext = nullptr;
 ID3D11ComputeShader*        g_pCS = nullptr;
 
-// Particle self shadowing task
-// X - forward
-// Y - up
-// Z - right
-
 ID3D11Buffer* particlesBuffer = nullptr;
 ID3D11Buffer* shadowBuffer = nullptr;
 ID3D11Buffer* constBuffer = nullptr;
 ID3D11ShaderResourceView* particlesBufferSRV = nullptr;
 ID3D11UnorderedAccessView*  shadowBufferUAV = nullptr;
 
-struct Pos {
-	float x, y, z;
-};
-
-struct Particle {
-	Pos pos;
-	float radius;
-	float opacity;
-};
-
-float Smoothstep(float edge0, float edge1, float value) {
-	const float t = min(max((value - edge0) / (edge1 - edge0), 0.0f), 1.0f);
-	return t * t * (3.0 - 2.0 * t);
-}
-
 float Overlap(float dir[4], const Particle & caster, const Particle & receiver) {
 	
 	const float dReceiver{ dir[0] * receiver.pos.x + dir[1] * receiver.pos.y + dir[2] * receiver.pos.z };
@@ -109,26 +118,48 @@ float Overlap(float dir[4], const Particle & caster, const Particle & receiver)
 }
 
 
+// Thread group size of csComputeSelfShadowing, passed to compute.hlsl when it is compiled
 #define THREAD_X 32
 #define THREAD_Y 32
 
+#define STRINGIFY_IMPL(x) #x
+#define STRINGIFY(x) STRINGIFY_IMPL(x)
+
 std::array<Particle, THREAD_X * THREAD_Y> particlesArr;
 float sunDir[4];
 
 void CreateIOBuffers();
 void SetUniforms();
 void TestOverlapHost();
+void TestSceneGenerator();
+void TestShadowKernels();
 void TestResult(float result[THREAD_X * THREAD_Y]);
+void TestSharded();
+void TestShadowsApi();
+void BenchmarkCpuEngine();
+void BenchmarkSceneGenerator();
 
 //--------------------------------------------------------------------------------------
 // Entry point to the program
 //--------------------------------------------------------------------------------------
-int __cdecl main()
+int __cdecl main(int argc, char* argv[])
 {
+	if (IsShardWorkerCommandLine(argc, argv)) {
+		return RunShardWorker(argc, argv);
+	}
+
 	printf("Test covering function...");
 	TestOverlapHost();
 	printf("done\n");
 
+	printf("Test scene generator...");
+	TestSceneGenerator();
+	printf("done\n");
+
+	printf("Test CPU kernels...");
+	TestShadowKernels();
+	printf("done\n");
+
     printf( "Creating device..." );
     if ( FAILED( CreateComputeDevice( &g_pDevice, &g_pContext, false ) ) )
         return 1;
@@ -170,6 +201,28 @@ int __cdecl main()
 
         SAFE_RELEASE( debugbuf );
     }
+
+#ifdef SHARD_COUNT
+	printf("Verifying sharded CPU evaluation...");
+	TestSharded();
+	printf("done\n");
+#endif
+
+	printf("Verifying C interface...");
+	TestShadowsApi();
+	printf("done\n");
+
+#ifdef BENCHMARK_CPU_ENGINE
+	printf("Benchmarking CPU engine...\n");
+	BenchmarkCpuEngine();
+	printf("done\n");
+#endif
+
+#ifdef BENCHMARK_SCENE_GENERATOR
+	printf("Benchmarking scene generator...\n");
+	BenchmarkSceneGenerator();
+	printf("done\n");
+#endif
     
     printf( "Cleaning up...\n" );
 	SAFE_RELEASE(particlesBufferSRV);
@@ -323,6 +376,9 @@ HRESULT CreateComputeShader( LPCWSTR pSrcFile, LPCSTR pFunctionName,
 #ifdef TEST_DOUBLE
         "TEST_DOUBLE", "1",
 #endif
+
+        "THREAD_X", STRINGIFY(THREAD_X),
+        "THREAD_Y", STRINGIFY(THREAD_Y),
         nullptr, nullptr
     };
 
@@ -667,9 +723,6 @@ HRESULT FindDXSDKShaderFileCch( WCHAR* strDestPath,
 
 void CreateIOBuffers()
 {
-
-#define frand() (static_cast <float> (rand()) / static_cast <float> (RAND_MAX))
-
 	const float revLen = 1.0f / sqrtf(0.5f * 0.5f + 0.2f * 0.2f + 0.3f * 0.3f);
 
 	sunDir[0] = 0.5f * revLen;
@@ -677,17 +730,14 @@ void CreateIOBuffers()
 	sunDir[2] = 0.3f * revLen;
 	sunDir[3] = 0.0f;
 
-	const float sizeX{ 10.0f }, sizeY{ 10.0f }, sizeZ{ 10.0f };
-
+	SceneDesc scene = {};
+	scene.seed = SCENE_SEED;
+	scene.distribution = SCENE_UNIFORM;
+	scene.size = { 10.0f, 10.0f, 10.0f };
+	scene.radius = { SCENE_LAW_UNIFORM, 0.0f, 1.0f };
+	scene.opacity = { SCENE_LAW_UNIFORM, 0.0f, 1.0f };
 
-	for (auto & particle : particlesArr) {
-
-		particle.pos.x = (frand() - 0.5f) * sizeX;
-		particle.pos.y = (frand() - 0.5f) * sizeY;
-		particle.pos.z = (frand() - 0.5f) * sizeZ;
-		particle.radius = frand();
-		particle.opacity = frand();
-	}
+	GenerateScene(&scene, &particlesArr[0], UINT(particlesArr.size()));
 
 	CreateStructuredBuffer(g_pDevice, sizeof(Particle), particlesArr.size() , &particlesArr[0], &particlesBuffer);
 	CreateStructuredBuffer(g_pDevice, sizeof(float), particlesArr.size(), nullptr, &shadowBuffer);
@@ -747,6 +797,120 @@ void TestOverlapHost()
 
 }
 
+void TestSceneGenerator()
+{
+	const UINT count = 100000;
+	std::vector<Particle> serial(count), parallel(count);
+
+	// Raw bits of a few particles of every distribution: any change to the random numbers or to the
+	// way they are turned into particles breaks the scenes of every other machine and shows up here
+	const UINT goldenIndices[3] = { 0, 1, 77777 };
+	const UINT golden[4][3][5] = {
+		// SCENE_UNIFORM
+		{
+			{ 0x3f9096b0, 0xbea0d64c, 0xc08890dc, 0x3deb2e78, 0x3efb7eba },
+			{ 0x409c11e9, 0xbfdd5be4, 0x3e0e6610, 0x3d88bf17, 0x3ed101fe },
+			{ 0xc05565f8, 0xc00c424a, 0xc0852857, 0x3d5a0c57, 0x3f540104 },
+		},
+		// SCENE_GAUSSIAN_CLUSTERS
+		{
+			{ 0xc062a2c2, 0x3fa82511, 0xc076e6e6, 0x3deb2e78, 0x3efb7eba },
+			{ 0xc07ad1f9, 0x3f9ef1e9, 0xc0228b79, 0x3d88bf17, 0x3ed101fe },
+			{ 0xc093f560, 0x409e82bd, 0xc05820d3, 0x3d5a0c57, 0x3f540104 },
+		},
+		// SCENE_SLABS
+		{
+			{ 0x3f9096b0, 0x3fe52114, 0xc08890dc, 0x3deb2e78, 0x3efb7eba },
+			{ 0x409c11e9, 0x3fdc125d, 0x3e0e6610, 0x3d88bf17, 0x3ed101fe },
+			{ 0xc05565f8, 0x4099c4fc, 0xc0852857, 0x3d5a0c57, 0x3f540104 },
+		},
+		// SCENE_SHELLS
+		{
+			{ 0xc077cba1, 0x3fb5f0c4, 0xc06fae38, 0x3deb2e78, 0x3efb7eba },
+			{ 0xc0962b95, 0x3f86ddf5, 0xc0325369, 0x3d88bf17, 0x3ed101fe },
+			{ 0xc04ec153, 0x40390d19, 0xc07e6faa, 0x3d5a0c57, 0x3f540104 },
+		},
+	};
+	static_assert(sizeof(Particle) == sizeof(golden[0][0]), "Golden particles are 5 raw floats");
+
+	const SceneDistribution distributions[] = { SCENE_UNIFORM, SCENE_GAUSSIAN_CLUSTERS, SCENE_SLABS, SCENE_SHELLS };
+	for (int d = 0; d < 4; ++d) {
+		SceneDesc scene = {};
+		scene.seed = SCENE_SEED;
+		scene.distribution = distributions[d];
+		scene.size = { 10.0f, 10.0f, 10.0f };
+		scene.numFeatures = 5;
+		scene.featureWidth = 0.5f;
+		scene.radius = { SCENE_LAW_QUADRATIC, 0.05f, 1.0f };
+		scene.opacity = { SCENE_LAW_UNIFORM, 0.0f, 1.0f };
+
+		scene.numThreads = 1;
+		HRESULT hr = GenerateScene(&scene, &serial[0], count);
+		assert(SUCCEEDED(hr));
+
+		scene.numThreads = 7;
+		hr = GenerateScene(&scene, &parallel[0], count);
+		assert(SUCCEEDED(hr));
+
+		assert(memcmp(&serial[0], &parallel[0], count * sizeof(Particle)) == 0);
+
+		for (const auto & particle : serial) {
+			assert(particle.radius >= 0.05f && particle.radius < 1.0f);
+			assert(particle.opacity >= 0.0f && particle.opacity < 1.0f);
+		}
+
+		for (int i = 0; i < 3; ++i) {
+			assert(memcmp(&serial[goldenIndices[i]], golden[d][i], sizeof(Particle)) == 0);
+		}
+	}
+}
+
+void TestShadowKernels()
+{
+	const UINT count = 1000;
+	std::vector<Particle> particles(count), projected(count);
+
+	SceneDesc scene = {};
+	scene.seed = SCENE_SEED;
+	scene.distribution = SCENE_UNIFORM;
+	scene.size = { 10.0f, 10.0f, 10.0f };
+	scene.radius = { SCENE_LAW_UNIFORM, 0.0f, 1.0f };
+	scene.opacity = { SCENE_LAW_UNIFORM, 0.0f, 1.0f };
+
+	HRESULT hr = GenerateScene(&scene, &particles[0], count);
+	assert(SUCCEEDED(hr));
+
+	// The [0, 1) radius law does produce zero radii: both smoothstep edges are equal then
+	particles[500].radius = 0.0f;
+
+	float dir[4] = { 0.5f, 0.2f, 0.3f, 0.0f };
+	const float revLen = 1.0f / sqrtf(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+	dir[0] *= revLen;
+	dir[1] *= revLen;
+	dir[2] *= revLen;
+	ProjectParticles(dir, &particles[0], count, &projected[0]);
+
+	std::vector<float> expected(count), result(count);
+	for (UINT i = 0; i < count; ++i) {
+		expected[i] = 1.0f;
+		for (UINT j = 0; j < count; ++j) {
+			if (i != j) {
+				expected[i] *= 1.0f - OverlapProjected(projected[j], projected[i]);
+			}
+		}
+	}
+
+	for (UINT k = 0; k < GetShadowKernelCount(); ++k) {
+		const ShadowKernelInfo* pKernel = GetShadowKernel(k);
+		if (pKernel->precision != CPU_PRECISION_EXACT) {
+			continue;
+		}
+
+		pKernel->pFunction(&projected[0], count, 0, count, &result[0]);
+		assert(memcmp(&result[0], &expected[0], count * sizeof(float)) == 0);
+	}
+}
+
 void TestResult(float result[THREAD_X * THREAD_Y])
 {
 	static std::array<float, THREAD_X * THREAD_Y> expected;
@@ -770,3 +934,218 @@ void TestResult(float result[THREAD_X * THREAD_Y])
 		assert(abs(result[i] - expected[i]) < diff);
 	}
 }
+
+void TestSharded()
+{
+	std::vector<Particle> projected(particlesArr.size());
+	ProjectParticles(sunDir, &particlesArr[0], UINT(particlesArr.size()), &projected[0]);
+
+	std::vector<float> single(particlesArr.size());
+	HRESULT hr = ComputeShadowsCPU(&projected[0], UINT(projected.size()), 0, UINT(projected.size()), &single[0], 0);
+	assert(SUCCEEDED(hr));
+
+	// Both backings, then a crashed and a hung worker, which must be restarted and give the same result
+	const struct {
+		LPCSTR pBackingPath;
+		ShardFault fault;
+	} runs[] = {
+		{ nullptr, SHARD_FAULT_NONE },
+		{ "shards.bin", SHARD_FAULT_NONE },
+		{ nullptr, SHARD_FAULT_CRASH },
+		{ "shards.bin", SHARD_FAULT_HANG },
+	};
+
+	for (const auto& run : runs) {
+		ShardRunDesc desc = {};
+		desc.shardCount = SHARD_COUNT;
+		desc.pBackingPath = run.pBackingPath;
+		desc.shardTimeoutMs = SHARD_TIMEOUT_MS;
+		desc.fault = run.fault;
+		desc.faultShard = SHARD_COUNT - 1;
+
+		std::vector<float> sharded(particlesArr.size());
+		auto begin = std::chrono::high_resolution_clock::now();
+		hr = RunShardedShadows(&projected[0], UINT(projected.size()), &desc, &sharded[0]);
+		const long long elapsed = (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - begin)).count();
+		assert(SUCCEEDED(hr));
+		assert(memcmp(&single[0], &sharded[0], single.size() * sizeof(float)) == 0);
+
+		// A crash is noticed from the exit code, only a hang may wait for the timeout
+		if (run.fault == SHARD_FAULT_CRASH) {
+			assert(elapsed < SHARD_TIMEOUT_MS / 2);
+		}
+		if (run.fault == SHARD_FAULT_HANG) {
+			assert(elapsed >= SHARD_TIMEOUT_MS);
+		}
+	}
+
+	TestResult(&single[0]);
+}
+
+void TestShadowsApi()
+{
+	const UINT count = UINT(particlesArr.size());
+
+	// The second light is not a multiple of the first, so a wrong per light offset or projection state
+	// left over from the previous light shows up. Each light has its own reference.
+	float dirs[2][4] = { { sunDir[0], sunDir[1], sunDir[2], 0.0f }, { -0.3f, 0.8f, 0.5f, 0.0f } };
+	std::vector<float> expected[2];
+
+	for (int light = 0; light < 2; ++light) {
+		float* pDir = dirs[light];
+		const float revLen = 1.0f / sqrtf(pDir[0] * pDir[0] + pDir[1] * pDir[1] + pDir[2] * pDir[2]);
+		pDir[0] *= revLen;
+		pDir[1] *= revLen;
+		pDir[2] *= revLen;
+
+		std::vector<Particle> projected(count);
+		ProjectParticles(pDir, &particlesArr[0], count, &projected[0]);
+
+		expected[light].resize(count);
+		HRESULT hr = ComputeShadowsCPU(&projected[0], count, 0, count, &expected[light][0], 0);
+		assert(SUCCEEDED(hr));
+	}
+	assert(memcmp(&expected[0][0], &expected[1][0], count * sizeof(float)) != 0);
+
+	// The library normalizes the directions, the second one goes in unnormalized. A third light exceeds maxLights.
+	const float lights[9] = { dirs[0][0], dirs[0][1], dirs[0][2], -0.6f, 1.6f, 1.0f, 0.0f, 0.0f, 1.0f };
+	bool passed[2] = {};
+
+	// Two independent contexts evaluated concurrently must both match the engine
+	auto run = [&](int index) {
+		ShadowsContextDesc desc = {};
+		desc.structSize = sizeof(desc);
+		desc.maxParticles = count;
+		desc.maxLights = 2;
+		desc.flags = SHADOWS_FLAG_NUMA_AWARE;
+		desc.precision = SHADOWS_PRECISION_EXACT;
+		desc.profilePath = CPU_ENGINE_DEFAULT_PROFILE;
+
+		ShadowsContext* pContext = nullptr;
+		if (ShadowsCreateContext(&desc, &pContext) != SHADOWS_OK) {
+			return;
+		}
+
+		std::vector<float> shadows(count);
+		ShadowsStats stats = {};
+		passed[index] =
+			ShadowsSubmitParticles(pContext, reinterpret_cast<const ShadowsParticle*>(&particlesArr[0]), count) == SHADOWS_OK &&
+			ShadowsSubmitLights(pContext, lights, 3) == SHADOWS_ERROR_CAPACITY &&
+			ShadowsSubmitLights(pContext, lights, 2) == SHADOWS_OK &&
+			ShadowsGetResults(pContext, 0, &shadows[0], count) == SHADOWS_ERROR_NOT_EVALUATED &&
+			ShadowsEvaluate(pContext) == SHADOWS_OK &&
+			ShadowsGetStats(pContext, &stats) == SHADOWS_OK;
+
+		passed[index] = passed[index] && stats.particleCount == count && stats.lightCount == 2 && stats.evaluationCount == 1 &&
+			stats.threadCount > 0 && stats.nodeCount > 0;
+
+		// The lights are renormalized by the library, so the match is within the GPU verification tolerance
+		for (uint32_t light = 0; light < 2 && passed[index]; ++light) {
+			passed[index] = ShadowsGetResults(pContext, light, &shadows[0], count) == SHADOWS_OK;
+			for (size_t i = 0; i < shadows.size() && passed[index]; ++i) {
+				passed[index] = abs(shadows[i] - expected[light][i]) < 1e-5f;
+			}
+		}
+
+		ShadowsDestroyContext(pContext);
+	};
+
+	std::thread other(run, 1);
+	run(0);
+	other.join();
+
+	assert(passed[0] && passed[1]);
+}
+
+void BenchmarkCpuEngine()
+{
+	SceneDesc scene = {};
+	scene.seed = SCENE_SEED;
+	scene.distribution = SCENE_UNIFORM;
+	scene.size = { 100.0f, 100.0f, 100.0f };
+	scene.radius = { SCENE_LAW_UNIFORM, 0.0f, 1.0f };
+	scene.opacity = { SCENE_LAW_UNIFORM, 0.0f, 1.0f };
+
+	std::vector<Particle> particles(NUM_BENCHMARK_ELEMENTS);
+	GenerateScene(&scene, &particles[0], UINT(particles.size()));
+
+	std::vector<Particle> projected(particles.size());
+	ProjectParticles(sunDir, &particles[0], UINT(particles.size()), &projected[0]);
+
+	std::vector<float> shadows[2] = { std::vector<float>(particles.size()), std::vector<float>(particles.size()) };
+	long long elapsed[2] = {};
+	HRESULT hr = S_OK;
+
+	for (int numaAware = 0; numaAware < 2; ++numaAware) {
+		CpuEngineDesc desc = {};
+		desc.numThreads = 0;
+		desc.bNumaAware = numaAware != 0;
+		desc.maxParticles = UINT(particles.size());
+		desc.precision = CPU_PRECISION_EXACT;
+		desc.pProfilePath = CPU_ENGINE_DEFAULT_PROFILE;
+
+		CpuEngine* pEngine = nullptr;
+		hr = CreateCpuEngine(&desc, &pEngine);
+		assert(SUCCEEDED(hr));
+
+		// An empty receiver range picks this engine's kernel and touches its replicas, so neither
+		// autotuning nor the first page faults are timed
+		hr = RunCpuEngine(pEngine, &projected[0], UINT(projected.size()), 0, 0, &shadows[numaAware][0]);
+		assert(SUCCEEDED(hr));
+
+		for (int repeat = 0; repeat < NUM_BENCHMARK_REPEATS; ++repeat) {
+			auto begin = std::chrono::high_resolution_clock::now();
+			hr = RunCpuEngine(pEngine, &projected[0], UINT(projected.size()), 0, UINT(projected.size()), &shadows[numaAware][0]);
+			const long long time = (std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - begin)).count();
+			assert(SUCCEEDED(hr));
+
+			elapsed[numaAware] = repeat == 0 ? time : (std::min)(elapsed[numaAware], time);
+		}
+
+		printf("%s: %u nodes, %u threads, best of %d: %.2f milliseconds\n", numaAware ? "NUMA aware" : "naive",
+			GetCpuEngineNodeCount(pEngine), GetCpuEngineThreadCount(pEngine), NUM_BENCHMARK_REPEATS, elapsed[numaAware] / 1000.0);
+
+		ReleaseCpuEngine(pEngine);
+	}
+
+	printf("NUMA aware speedup: %.2fx\n", double(elapsed[0]) / double((std::max)(elapsed[1], 1LL)));
+
+	assert(memcmp(&shadows[0][0], &shadows[1][0], shadows[0].size() * sizeof(float)) == 0);
+}
+
+void BenchmarkSceneGenerator()
+{
+	// Every distribution, shells need the most random numbers per particle
+	const struct {
+		SceneDistribution distribution;
+		LPCSTR pName;
+	} distributions[] = {
+		{ SCENE_UNIFORM, "uniform" },
+		{ SCENE_GAUSSIAN_CLUSTERS, "clusters" },
+		{ SCENE_SLABS, "slabs" },
+		{ SCENE_SHELLS, "shells" },
+	};
+
+	std::vector<Particle> particles(NUM_GENERATED_ELEMENTS);
+
+	// GenerateScene() uses all the hardware threads for a scene this large
+	const UINT numThreads = (std::max)(std::thread::hardware_concurrency(), 1u);
+
+	for (const auto& desc : distributions) {
+		SceneDesc scene = {};
+		scene.seed = SCENE_SEED;
+		scene.distribution = desc.distribution;
+		scene.size = { 100.0f, 100.0f, 100.0f };
+		scene.numFeatures = 16;
+		scene.featureWidth = 5.0f;
+		scene.radius = { SCENE_LAW_UNIFORM, 0.0f, 1.0f };
+		scene.opacity = { SCENE_LAW_UNIFORM, 0.0f, 1.0f };
+		scene.numThreads = numThreads;
+
+		auto begin = std::chrono::high_resolution_clock::now();
+		HRESULT hr = GenerateScene(&scene, &particles[0], UINT(particles.size()));
+		printf("%s: %u particles, %u threads, %lld milliseconds\n", desc.pName, NUM_GENERATED_ELEMENTS, numThreads,
+			(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - begin)).count());
+		assert(SUCCEEDED(hr));
+	}
+}
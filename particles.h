@@ -0,0 +1,29 @@
+//--------------------------------------------------------------------------------------
+// File: particles.h
+//
+// Particle layout shared by the host code, the CPU engine and compute.hlsl
+//--------------------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+
+// Particle self shadowing task
+// X - forward
+// Y - up
+// Z - right
+
+struct Pos {
+	float x, y, z;
+};
+
+struct Particle {
+	Pos pos;
+	float radius;
+	float opacity;
+};
+
+inline float Smoothstep(float edge0, float edge1, float value) {
+	const float t = (std::min)((std::max)((value - edge0) / (edge1 - edge0), 0.0f), 1.0f);
+	return t * t * (3.0 - 2.0 * t);
+}
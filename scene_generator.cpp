@@ -0,0 +1,230 @@
+//--------------------------------------------------------------------------------------
+// File: scene_generator.cpp
+//
+// Seeded parallel particle scene generator
+//--------------------------------------------------------------------------------------
+
+#include "scene_generator.h"
+
+#include <math.h>
+#include <thread>
+#include <vector>
+
+// Contracting a * b + c into an FMA changes the rounding, the scenes must not depend on /arch or /fp:contract
+#pragma fp_contract(off)
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+// Second counter word: independent streams of the same particle
+enum SceneStream : UINT {
+	SCENE_STREAM_POSITION,
+	SCENE_STREAM_VALUES,
+	// Shell directions rejected from the position block take SCENE_STREAM_RETRY, SCENE_STREAM_RETRY + 1, ...
+	SCENE_STREAM_RETRY,
+};
+
+// Third counter word: particles and features never share a counter
+enum SceneDomain : UINT {
+	SCENE_DOMAIN_PARTICLE,
+	SCENE_DOMAIN_FEATURE,
+};
+
+struct PhiloxBlock {
+	UINT v[4];
+};
+
+struct SceneFeature {
+	Pos center;
+	float radius;
+};
+
+static PhiloxBlock Philox4x32(UINT index, UINT stream, UINT domain, ULONGLONG seed)
+{
+	UINT c0 = index, c1 = stream, c2 = domain, c3 = 0;
+	UINT k0 = UINT(seed), k1 = UINT(seed >> 32);
+
+	for (int round = 0; round < PHILOX_ROUNDS; ++round) {
+		const ULONGLONG p0 = ULONGLONG(PHILOX_M0) * c0;
+		const ULONGLONG p1 = ULONGLONG(PHILOX_M1) * c2;
+
+		c0 = UINT(p1 >> 32) ^ c1 ^ k0;
+		c1 = UINT(p1);
+		c2 = UINT(p0 >> 32) ^ c3 ^ k1;
+		c3 = UINT(p0);
+
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+
+	return { { c0, c1, c2, c3 } };
+}
+
+// [0, 1) with 24 bits, exact in float
+static inline float ToUnit(UINT x)
+{
+	return float(x >> 8) * (1.0f / 16777216.0f);
+}
+
+// (-1, 1) with 16 bits, exact in float
+static inline float ToSigned(UINT x)
+{
+	return (float(x & 0xFFFF) + 0.5f) * (1.0f / 32768.0f) - 1.0f;
+}
+
+// Irwin-Hall approximation of the standard normal distribution, it needs no log/cos from the C runtime.
+// The four terms are the 16 bit halves of two words, their integer sum is exact in float.
+static inline float ToGaussian(UINT a, UINT b)
+{
+	const UINT sum = (a & 0xFFFF) + (a >> 16) + (b & 0xFFFF) + (b >> 16);
+	return (float(sum) * (1.0f / 65536.0f) - 2.0f) * 1.7320508f;
+}
+
+// x has 16 bits
+static inline UINT PickFeature(UINT x, UINT numFeatures)
+{
+	return UINT((ULONGLONG(x) * numFeatures) >> 16);
+}
+
+// Uniform direction by rejection from the cube: a block holds two tries of three 16 bit coordinates,
+// and a point inside the unit ball is normalized with sqrtf only, which is correctly rounded.
+// Both tries are computed and selected without branching, the test is a coin flip for the predictor.
+static bool TryDirection(const PhiloxBlock& block, Pos* pDir)
+{
+	const Pos a{ ToSigned(block.v[0]), ToSigned(block.v[0] >> 16), ToSigned(block.v[1]) };
+	const Pos b{ ToSigned(block.v[1] >> 16), ToSigned(block.v[2]), ToSigned(block.v[2] >> 16) };
+	const float len2A = a.x * a.x + a.y * a.y + a.z * a.z;
+	const float len2B = b.x * b.x + b.y * b.y + b.z * b.z;
+
+	// The coordinates are never 0, so neither is the length
+	const bool bInsideA = len2A <= 1.0f;
+	const Pos& p = bInsideA ? a : b;
+	const float revLen = 1.0f / sqrtf(bInsideA ? len2A : len2B);
+
+	*pDir = { p.x * revLen, p.y * revLen, p.z * revLen };
+	return bInsideA || len2B <= 1.0f;
+}
+
+static float ApplyValueLaw(const SceneValueDesc& desc, UINT x)
+{
+	const float u = ToUnit(x);
+
+	switch (desc.law) {
+	case SCENE_LAW_UNIFORM:
+		return desc.min + (desc.max - desc.min) * u;
+	case SCENE_LAW_QUADRATIC:
+		return desc.min + (desc.max - desc.min) * (u * u);
+	default:
+		return desc.min;
+	}
+}
+
+static SceneFeature GenerateFeature(const SceneDesc& desc, UINT index)
+{
+	const PhiloxBlock block = Philox4x32(index, SCENE_STREAM_POSITION, SCENE_DOMAIN_FEATURE, desc.seed);
+	const float minSize = (std::min)(desc.size.x, (std::min)(desc.size.y, desc.size.z));
+
+	SceneFeature feature;
+	feature.center.x = (ToUnit(block.v[0]) - 0.5f) * desc.size.x;
+	feature.center.y = (ToUnit(block.v[1]) - 0.5f) * desc.size.y;
+	feature.center.z = (ToUnit(block.v[2]) - 0.5f) * desc.size.z;
+	feature.radius = (0.1f + 0.4f * ToUnit(block.v[3])) * minSize;
+	return feature;
+}
+
+static Particle GenerateParticle(const SceneDesc& desc, const SceneFeature* pFeatures, UINT numFeatures, UINT index)
+{
+	// Two blocks per particle, except for the shell directions rejected from the position block.
+	// values: radius and opacity in the high 24 bits of v[0] and v[1], the feature in their low 8 bits,
+	// v[2] and v[3] for the third gaussian or the shell radius.
+	const PhiloxBlock position = Philox4x32(index, SCENE_STREAM_POSITION, SCENE_DOMAIN_PARTICLE, desc.seed);
+	const PhiloxBlock values = Philox4x32(index, SCENE_STREAM_VALUES, SCENE_DOMAIN_PARTICLE, desc.seed);
+
+	Particle particle;
+	particle.radius = ApplyValueLaw(desc.radius, values.v[0]);
+	particle.opacity = ApplyValueLaw(desc.opacity, values.v[1]);
+
+	const UINT featureBits = ((values.v[0] & 0xFF) << 8) | (values.v[1] & 0xFF);
+	const SceneFeature& feature = pFeatures[PickFeature(featureBits, numFeatures)];
+
+	switch (desc.distribution) {
+	case SCENE_GAUSSIAN_CLUSTERS:
+		particle.pos.x = feature.center.x + ToGaussian(position.v[0], position.v[1]) * desc.featureWidth;
+		particle.pos.y = feature.center.y + ToGaussian(position.v[2], position.v[3]) * desc.featureWidth;
+		particle.pos.z = feature.center.z + ToGaussian(values.v[2], values.v[3]) * desc.featureWidth;
+		break;
+	case SCENE_SLABS:
+		particle.pos.x = (ToUnit(position.v[0]) - 0.5f) * desc.size.x;
+		particle.pos.y = feature.center.y + (ToUnit(position.v[1]) - 0.5f) * desc.featureWidth;
+		particle.pos.z = (ToUnit(position.v[2]) - 0.5f) * desc.size.z;
+		break;
+	case SCENE_SHELLS:
+	{
+		// A block succeeds with probability 1 - (1 - pi/6)^2 ~ 0.77, so about 1.3 blocks per direction
+		Pos dir;
+		bool bFound = TryDirection(position, &dir);
+		for (UINT retry = 0; !bFound; ++retry) {
+			bFound = TryDirection(Philox4x32(index, SCENE_STREAM_RETRY + retry, SCENE_DOMAIN_PARTICLE, desc.seed), &dir);
+		}
+
+		const float radius = feature.radius + (ToUnit(values.v[2]) - 0.5f) * desc.featureWidth;
+		particle.pos.x = feature.center.x + dir.x * radius;
+		particle.pos.y = feature.center.y + dir.y * radius;
+		particle.pos.z = feature.center.z + dir.z * radius;
+		break;
+	}
+	default:
+		particle.pos.x = (ToUnit(position.v[0]) - 0.5f) * desc.size.x;
+		particle.pos.y = (ToUnit(position.v[1]) - 0.5f) * desc.size.y;
+		particle.pos.z = (ToUnit(position.v[2]) - 0.5f) * desc.size.z;
+		break;
+	}
+
+	return particle;
+}
+
+static void GenerateRange(const SceneDesc* pDesc, const SceneFeature* pFeatures, UINT numFeatures, UINT first, UINT last, Particle* pParticlesOut)
+{
+	for (UINT i = first; i < last; ++i) {
+		pParticlesOut[i] = GenerateParticle(*pDesc, pFeatures, numFeatures, i);
+	}
+}
+
+HRESULT GenerateScene(const SceneDesc* pDesc, Particle* pParticlesOut, UINT count)
+{
+	if (!pDesc || (!pParticlesOut && count > 0)) {
+		return E_INVALIDARG;
+	}
+
+	const UINT numFeatures = pDesc->distribution == SCENE_UNIFORM ? 1 : (std::max)(pDesc->numFeatures, 1u);
+	std::vector<SceneFeature> features(numFeatures);
+	for (UINT i = 0; i < numFeatures; ++i) {
+		features[i] = GenerateFeature(*pDesc, i);
+	}
+
+	UINT numThreads = pDesc->numThreads ? pDesc->numThreads : (std::max)(std::thread::hardware_concurrency(), 1u);
+	numThreads = (std::min)(numThreads, (std::max)(count / 4096, 1u));
+
+	if (numThreads == 1) {
+		GenerateRange(pDesc, &features[0], numFeatures, 0, count, pParticlesOut);
+		return S_OK;
+	}
+
+	std::vector<std::thread> threads;
+	threads.reserve(numThreads);
+
+	for (UINT t = 0; t < numThreads; ++t) {
+		const UINT begin = UINT(ULONGLONG(count) * t / numThreads);
+		const UINT end = UINT(ULONGLONG(count) * (t + 1) / numThreads);
+		threads.emplace_back(GenerateRange, pDesc, &features[0], numFeatures, begin, end, pParticlesOut);
+	}
+
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	return S_OK;
+}
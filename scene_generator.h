@@ -0,0 +1,60 @@
+//--------------------------------------------------------------------------------------
+// File: scene_generator.h
+//
+// Seeded parallel particle scene generator
+//
+// Every particle is a pure function of the seed and its index (Philox4x32-10 counter based
+// random numbers, integer to float conversion and plain float arithmetic only), so the scene
+// is bit identical whatever the number of threads and does not depend on the C runtime.
+//--------------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include "particles.h"
+
+enum SceneDistribution {
+	// Uniform in the scene box
+	SCENE_UNIFORM,
+	// Gaussian clusters with random centers, featureWidth is the standard deviation
+	SCENE_GAUSSIAN_CLUSTERS,
+	// Slabs orthogonal to Y at random heights, featureWidth is the slab thickness
+	SCENE_SLABS,
+	// Spherical shells with random centers and radii, featureWidth is the shell thickness
+	SCENE_SHELLS,
+};
+
+enum SceneValueLaw {
+	// min
+	SCENE_LAW_CONSTANT,
+	// Uniform in [min, max)
+	SCENE_LAW_UNIFORM,
+	// min + (max - min) * u^2, more small values than large ones
+	SCENE_LAW_QUADRATIC,
+};
+
+struct SceneValueDesc {
+	SceneValueLaw law;
+	float min;
+	float max;
+};
+
+struct SceneDesc {
+	ULONGLONG seed;
+	SceneDistribution distribution;
+
+	// Scene box centered at the origin, the features are placed in it
+	Pos size;
+
+	// Number of clusters, slabs or shells
+	UINT numFeatures;
+	float featureWidth;
+
+	SceneValueDesc radius;
+	SceneValueDesc opacity;
+
+	// 0 - all the hardware threads
+	UINT numThreads;
+};
+
+HRESULT GenerateScene(const SceneDesc* pDesc, Particle* pParticlesOut, UINT count);
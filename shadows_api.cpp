@@ -0,0 +1,236 @@
+//--------------------------------------------------------------------------------------
+// File: shadows_api.cpp
+//
+// Plain C interface of the CPU particle self shadowing library
+//--------------------------------------------------------------------------------------
+
+#include "shadows_api.h"
+#include "cpu_engine.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <chrono>
+#include <new>
+#include <vector>
+
+static_assert(sizeof(ShadowsParticle) == sizeof(Particle), "ShadowsParticle must match Particle");
+static_assert(offsetof(ShadowsParticle, radius) == offsetof(Particle, radius), "ShadowsParticle must match Particle");
+static_assert(offsetof(ShadowsParticle, opacity) == offsetof(Particle, opacity), "ShadowsParticle must match Particle");
+
+static_assert(UINT(SHADOWS_PRECISION_EXACT) == UINT(CPU_PRECISION_EXACT) &&
+              UINT(SHADOWS_PRECISION_FAST) == UINT(CPU_PRECISION_FAST) &&
+              UINT(SHADOWS_PRECISION_HIGH) == UINT(CPU_PRECISION_HIGH), "ShadowsPrecision must match CpuPrecision");
+
+struct ShadowsContext {
+	CpuEngine* pEngine;
+	UINT maxParticles;
+	UINT maxLights;
+
+	UINT particleCount;
+	UINT lightCount;
+	bool bEvaluated;
+
+	std::vector<Particle> particles;
+	std::vector<Particle> projected;
+	// 4 floats per light, the layout ProjectParticles() takes
+	std::vector<float> lights;
+	// maxParticles floats per light
+	std::vector<float> shadows;
+
+	ULONGLONG evaluationCount;
+	double lastEvaluateMilliseconds;
+};
+
+static ShadowsResult ToShadowsResult(HRESULT hr)
+{
+	if (SUCCEEDED(hr)) {
+		return SHADOWS_OK;
+	}
+
+	switch (hr) {
+	case E_INVALIDARG:
+		return SHADOWS_ERROR_INVALID_ARGUMENT;
+	case E_OUTOFMEMORY:
+		return SHADOWS_ERROR_OUT_OF_MEMORY;
+	default:
+		return SHADOWS_ERROR_INTERNAL;
+	}
+}
+
+ShadowsResult SHADOWS_CALL ShadowsCreateContext(const ShadowsContextDesc* pDesc, ShadowsContext** ppContext)
+{
+	if (!ppContext) {
+		return SHADOWS_ERROR_INVALID_ARGUMENT;
+	}
+	*ppContext = nullptr;
+
+	if (!pDesc || pDesc->structSize < sizeof(ShadowsContextDesc) || pDesc->maxParticles == 0 || pDesc->maxLights == 0 ||
+		pDesc->precision >= CPU_PRECISION_COUNT) {
+		return SHADOWS_ERROR_INVALID_ARGUMENT;
+	}
+
+	// Nothing may throw across the C boundary, and this is the only call that allocates
+	ShadowsContext* pContext = new (std::nothrow) ShadowsContext();
+	if (!pContext) {
+		return SHADOWS_ERROR_OUT_OF_MEMORY;
+	}
+
+	pContext->pEngine = nullptr;
+	pContext->maxParticles = pDesc->maxParticles;
+	pContext->maxLights = pDesc->maxLights;
+	pContext->particleCount = 0;
+	pContext->lightCount = 0;
+	pContext->bEvaluated = false;
+	pContext->evaluationCount = 0;
+	pContext->lastEvaluateMilliseconds = 0.0;
+
+	try {
+		pContext->particles.resize(pDesc->maxParticles);
+		pContext->projected.resize(pDesc->maxParticles);
+		pContext->lights.resize(SIZE_T(pDesc->maxLights) * 4);
+		pContext->shadows.resize(SIZE_T(pDesc->maxLights) * pDesc->maxParticles);
+
+		CpuEngineDesc engineDesc = {};
+		engineDesc.numThreads = pDesc->numThreads;
+		engineDesc.bNumaAware = (pDesc->flags & SHADOWS_FLAG_NUMA_AWARE) != 0;
+		engineDesc.maxParticles = pDesc->maxParticles;
+		engineDesc.precision = CpuPrecision(pDesc->precision);
+		engineDesc.pProfilePath = pDesc->profilePath;
+
+		const HRESULT hr = CreateCpuEngine(&engineDesc, &pContext->pEngine);
+		if (FAILED(hr)) {
+			delete pContext;
+			return ToShadowsResult(hr);
+		}
+	} catch (...) {
+		ShadowsDestroyContext(pContext);
+		return SHADOWS_ERROR_OUT_OF_MEMORY;
+	}
+
+	*ppContext = pContext;
+	return SHADOWS_OK;
+}
+
+void SHADOWS_CALL ShadowsDestroyContext(ShadowsContext* pContext)
+{
+	if (!pContext) {
+		return;
+	}
+
+	ReleaseCpuEngine(pContext->pEngine);
+	delete pContext;
+}
+
+ShadowsResult SHADOWS_CALL ShadowsSubmitParticles(ShadowsContext* pContext, const ShadowsParticle* pParticles, uint32_t count)
+{
+	if (!pContext || (!pParticles && count > 0)) {
+		return SHADOWS_ERROR_INVALID_ARGUMENT;
+	}
+	if (count > pContext->maxParticles) {
+		return SHADOWS_ERROR_CAPACITY;
+	}
+
+	if (count > 0) {
+		memcpy(&pContext->particles[0], pParticles, SIZE_T(count) * sizeof(Particle));
+	}
+	pContext->particleCount = count;
+	pContext->bEvaluated = false;
+
+	return SHADOWS_OK;
+}
+
+ShadowsResult SHADOWS_CALL ShadowsSubmitLights(ShadowsContext* pContext, const float* pDirections, uint32_t count)
+{
+	if (!pContext || (!pDirections && count > 0)) {
+		return SHADOWS_ERROR_INVALID_ARGUMENT;
+	}
+	if (count > pContext->maxLights) {
+		return SHADOWS_ERROR_CAPACITY;
+	}
+
+	// Validate everything first, so a rejected submission leaves the previous lights intact
+	for (uint32_t i = 0; i < count; ++i) {
+		const float* pDir = pDirections + i * 3;
+		const float len2 = pDir[0] * pDir[0] + pDir[1] * pDir[1] + pDir[2] * pDir[2];
+		const float horizontal2 = pDir[0] * pDir[0] + pDir[2] * pDir[2];
+
+		if (!(len2 > 0.0f) || !(horizontal2 > 1e-12f * len2)) {
+			return SHADOWS_ERROR_INVALID_ARGUMENT;
+		}
+	}
+
+	for (uint32_t i = 0; i < count; ++i) {
+		const float* pDir = pDirections + i * 3;
+		const float revLen = 1.0f / sqrtf(pDir[0] * pDir[0] + pDir[1] * pDir[1] + pDir[2] * pDir[2]);
+		float* pLight = &pContext->lights[SIZE_T(i) * 4];
+
+		pLight[0] = pDir[0] * revLen;
+		pLight[1] = pDir[1] * revLen;
+		pLight[2] = pDir[2] * revLen;
+		pLight[3] = 0.0f;
+	}
+	pContext->lightCount = count;
+	pContext->bEvaluated = false;
+
+	return SHADOWS_OK;
+}
+
+ShadowsResult SHADOWS_CALL ShadowsEvaluate(ShadowsContext* pContext)
+{
+	if (!pContext) {
+		return SHADOWS_ERROR_INVALID_ARGUMENT;
+	}
+
+	auto begin = std::chrono::high_resolution_clock::now();
+
+	const UINT count = pContext->particleCount;
+	for (UINT light = 0; light < pContext->lightCount && count > 0; ++light) {
+		ProjectParticles(&pContext->lights[SIZE_T(light) * 4], &pContext->particles[0], count, &pContext->projected[0]);
+
+		float* pShadows = &pContext->shadows[SIZE_T(light) * pContext->maxParticles];
+		const HRESULT hr = RunCpuEngine(pContext->pEngine, &pContext->projected[0], count, 0, count, pShadows);
+		if (FAILED(hr)) {
+			pContext->bEvaluated = false;
+			return ToShadowsResult(hr);
+		}
+	}
+
+	pContext->bEvaluated = true;
+	++pContext->evaluationCount;
+	pContext->lastEvaluateMilliseconds =
+		std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - begin).count();
+
+	return SHADOWS_OK;
+}
+
+ShadowsResult SHADOWS_CALL ShadowsGetResults(const ShadowsContext* pContext, uint32_t light, float* pShadows, uint32_t count)
+{
+	if (!pContext || (!pShadows && count > 0) || light >= pContext->lightCount || count > pContext->particleCount) {
+		return SHADOWS_ERROR_INVALID_ARGUMENT;
+	}
+	if (!pContext->bEvaluated) {
+		return SHADOWS_ERROR_NOT_EVALUATED;
+	}
+
+	if (count > 0) {
+		memcpy(pShadows, &pContext->shadows[SIZE_T(light) * pContext->maxParticles], SIZE_T(count) * sizeof(float));
+	}
+
+	return SHADOWS_OK;
+}
+
+ShadowsResult SHADOWS_CALL ShadowsGetStats(const ShadowsContext* pContext, ShadowsStats* pStats)
+{
+	if (!pContext || !pStats) {
+		return SHADOWS_ERROR_INVALID_ARGUMENT;
+	}
+
+	pStats->particleCount = pContext->particleCount;
+	pStats->lightCount = pContext->lightCount;
+	pStats->threadCount = GetCpuEngineThreadCount(pContext->pEngine);
+	pStats->nodeCount = GetCpuEngineNodeCount(pContext->pEngine);
+	pStats->evaluationCount = pContext->evaluationCount;
+	pStats->lastEvaluateMilliseconds = pContext->lastEvaluateMilliseconds;
+
+	return SHADOWS_OK;
+}
@@ -0,0 +1,118 @@
+/*--------------------------------------------------------------------------------------
+ * File: shadows_api.h
+ *
+ * Plain C interface of the CPU particle self shadowing library
+ *
+ * By default the functions are plain declarations, for shadows_api.cpp and the CPU engine
+ * sources (cpu_engine.cpp, cpu_kernels.cpp, autotune.cpp) compiled into the executable, as
+ * this sample does. To ship them as a DLL, build it with SHADOWS_EXPORTS defined and its
+ * clients with SHADOWS_DLL defined, linking shadows.lib:
+ *
+ *   cl /LD /O2 /EHsc /DSHADOWS_EXPORTS shadows_api.cpp cpu_engine.cpp cpu_kernels.cpp
+ *      autotune.cpp /link /DEF:shadows_api.def /OUT:shadows.dll
+ *
+ * shadows_api.def lists the exports under their plain names. The sample does not build the
+ * DLL, so this configuration is not compiled as part of it.
+ *
+ * A context owns all of its memory and worker threads, there is no global state:
+ * different contexts can be used concurrently from different threads, a single
+ * context must be used by one thread at a time. After ShadowsCreateContext() no
+ * call allocates, except for the first evaluation of a new particle count range,
+ * which autotunes the kernel and reads/appends the profile file if one is given.
+ *--------------------------------------------------------------------------------------*/
+
+#ifndef SHADOWS_API_H
+#define SHADOWS_API_H
+
+#include <stdint.h>
+
+#if defined(SHADOWS_EXPORTS)
+#define SHADOWS_API __declspec(dllexport)
+#elif defined(SHADOWS_DLL)
+#define SHADOWS_API __declspec(dllimport)
+#else
+#define SHADOWS_API
+#endif
+
+#define SHADOWS_CALL __cdecl
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ShadowsContext ShadowsContext;
+
+typedef enum ShadowsResult {
+	SHADOWS_OK = 0,
+	SHADOWS_ERROR_INVALID_ARGUMENT = -1,
+	/* More particles or lights than the context was created for */
+	SHADOWS_ERROR_CAPACITY = -2,
+	SHADOWS_ERROR_OUT_OF_MEMORY = -3,
+	/* Results are queried before ShadowsEvaluate() or after a new submission */
+	SHADOWS_ERROR_NOT_EVALUATED = -4,
+	SHADOWS_ERROR_INTERNAL = -5
+} ShadowsResult;
+
+typedef enum ShadowsPrecision {
+	SHADOWS_PRECISION_EXACT = 0,
+	SHADOWS_PRECISION_FAST = 1,
+	SHADOWS_PRECISION_HIGH = 2
+} ShadowsPrecision;
+
+/* Pins the workers to NUMA nodes and keeps a copy of the particles in every node's memory */
+#define SHADOWS_FLAG_NUMA_AWARE 0x1u
+
+typedef struct ShadowsParticle {
+	float x, y, z;
+	float radius;
+	float opacity;
+} ShadowsParticle;
+
+typedef struct ShadowsContextDesc {
+	/* sizeof(ShadowsContextDesc), lets later versions add fields */
+	uint32_t structSize;
+	uint32_t maxParticles;
+	uint32_t maxLights;
+	/* 0 - all the hardware threads */
+	uint32_t numThreads;
+	/* SHADOWS_FLAG_* */
+	uint32_t flags;
+	/* ShadowsPrecision */
+	uint32_t precision;
+	/* Autotune profile, NULL to tune without saving the decisions */
+	const char* profilePath;
+} ShadowsContextDesc;
+
+typedef struct ShadowsStats {
+	uint32_t particleCount;
+	uint32_t lightCount;
+	uint32_t threadCount;
+	uint32_t nodeCount;
+	uint64_t evaluationCount;
+	/* Wall time of the last ShadowsEvaluate() */
+	double lastEvaluateMilliseconds;
+} ShadowsStats;
+
+SHADOWS_API ShadowsResult SHADOWS_CALL ShadowsCreateContext(const ShadowsContextDesc* pDesc, ShadowsContext** ppContext);
+SHADOWS_API void SHADOWS_CALL ShadowsDestroyContext(ShadowsContext* pContext);
+
+/* Copies the particles into the context, count must not exceed maxParticles */
+SHADOWS_API ShadowsResult SHADOWS_CALL ShadowsSubmitParticles(ShadowsContext* pContext, const ShadowsParticle* pParticles, uint32_t count);
+
+/* Copies count light directions, 3 floats each, pointing towards the light. They are normalized
+ * and must not be parallel to the Y axis. count must not exceed maxLights. */
+SHADOWS_API ShadowsResult SHADOWS_CALL ShadowsSubmitLights(ShadowsContext* pContext, const float* pDirections, uint32_t count);
+
+/* Computes the shadow of every submitted particle for every submitted light */
+SHADOWS_API ShadowsResult SHADOWS_CALL ShadowsEvaluate(ShadowsContext* pContext);
+
+/* Copies count shadows of the light, count must not exceed the submitted particle count */
+SHADOWS_API ShadowsResult SHADOWS_CALL ShadowsGetResults(const ShadowsContext* pContext, uint32_t light, float* pShadows, uint32_t count);
+
+SHADOWS_API ShadowsResult SHADOWS_CALL ShadowsGetStats(const ShadowsContext* pContext, ShadowsStats* pStats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SHADOWS_API_H */
@@ -0,0 +1,385 @@
+//--------------------------------------------------------------------------------------
+// File: shards.cpp
+//
+// Multi-process sharded evaluation of particle self shadowing
+//--------------------------------------------------------------------------------------
+
+#include "shards.h"
+#include "cpu_engine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+
+#define SHARD_SEGMENT_MAGIC 0x57444853 // "SHDW"
+#define SHARD_SEGMENT_ALIGNMENT 64
+
+enum ShardState : LONG {
+	SHARD_PENDING = 0,
+	SHARD_DONE = 1,
+};
+
+// Segment layout: header | projected particles | shadows, every part aligned to SHARD_SEGMENT_ALIGNMENT
+struct ShardSegmentHeader {
+	UINT magic;
+	UINT particleCount;
+	UINT shardCount;
+	UINT reserved;
+	volatile LONG shardState[SHARD_MAX_COUNT];
+};
+
+struct ShardSegment {
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	HANDLE hMapping = nullptr;
+	void* pView = nullptr;
+	ShardSegmentHeader* pHeader = nullptr;
+	Particle* pParticles = nullptr;
+	float* pShadows = nullptr;
+};
+
+static SIZE_T AlignSegmentOffset(SIZE_T offset)
+{
+	return (offset + SHARD_SEGMENT_ALIGNMENT - 1) & ~SIZE_T(SHARD_SEGMENT_ALIGNMENT - 1);
+}
+
+static SIZE_T GetParticlesOffset()
+{
+	return AlignSegmentOffset(sizeof(ShardSegmentHeader));
+}
+
+static SIZE_T GetShadowsOffset(UINT count)
+{
+	return AlignSegmentOffset(GetParticlesOffset() + SIZE_T(count) * sizeof(Particle));
+}
+
+static SIZE_T GetSegmentSize(UINT count)
+{
+	return GetShadowsOffset(count) + SIZE_T(count) * sizeof(float);
+}
+
+static void ReleaseSegment(ShardSegment* pSegment)
+{
+	if (pSegment->pView) {
+		UnmapViewOfFile(pSegment->pView);
+	}
+	if (pSegment->hMapping) {
+		CloseHandle(pSegment->hMapping);
+	}
+	if (pSegment->hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(pSegment->hFile);
+	}
+	*pSegment = ShardSegment{};
+}
+
+static HRESULT MapSegment(ShardSegment* pSegment)
+{
+	pSegment->pView = MapViewOfFile(pSegment->hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (!pSegment->pView) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	BYTE* pBase = static_cast<BYTE*>(pSegment->pView);
+	pSegment->pHeader = reinterpret_cast<ShardSegmentHeader*>(pBase);
+	return S_OK;
+}
+
+static void SetSegmentPointers(ShardSegment* pSegment, UINT count)
+{
+	BYTE* pBase = static_cast<BYTE*>(pSegment->pView);
+	pSegment->pParticles = reinterpret_cast<Particle*>(pBase + GetParticlesOffset());
+	pSegment->pShadows = reinterpret_cast<float*>(pBase + GetShadowsOffset(count));
+}
+
+static HRESULT CreateSegment(LPCSTR pName, LPCSTR pBackingPath, UINT count, ShardSegment* pSegment)
+{
+	const ULONGLONG size = GetSegmentSize(count);
+
+	if (pBackingPath) {
+		pSegment->hFile = CreateFileA(pBackingPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (pSegment->hFile == INVALID_HANDLE_VALUE) {
+			return HRESULT_FROM_WIN32(GetLastError());
+		}
+	}
+
+	pSegment->hMapping = CreateFileMappingA(pSegment->hFile, nullptr, PAGE_READWRITE,
+		DWORD(size >> 32), DWORD(size & 0xFFFFFFFF), pBackingPath ? nullptr : pName);
+	if (!pSegment->hMapping) {
+		const HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+		ReleaseSegment(pSegment);
+		return hr;
+	}
+
+	const HRESULT hr = MapSegment(pSegment);
+	if (FAILED(hr)) {
+		ReleaseSegment(pSegment);
+		return hr;
+	}
+
+	SetSegmentPointers(pSegment, count);
+	return S_OK;
+}
+
+static HRESULT OpenSegment(bool bFileBacked, LPCSTR pNameOrPath, ShardSegment* pSegment)
+{
+	if (bFileBacked) {
+		pSegment->hFile = CreateFileA(pNameOrPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (pSegment->hFile == INVALID_HANDLE_VALUE) {
+			return HRESULT_FROM_WIN32(GetLastError());
+		}
+		pSegment->hMapping = CreateFileMappingA(pSegment->hFile, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+	} else {
+		pSegment->hMapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, pNameOrPath);
+	}
+
+	if (!pSegment->hMapping) {
+		const HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+		ReleaseSegment(pSegment);
+		return hr;
+	}
+
+	HRESULT hr = MapSegment(pSegment);
+	if (SUCCEEDED(hr) && (pSegment->pHeader->magic != SHARD_SEGMENT_MAGIC || pSegment->pHeader->shardCount > SHARD_MAX_COUNT)) {
+		hr = E_INVALIDARG;
+	}
+	if (FAILED(hr)) {
+		ReleaseSegment(pSegment);
+		return hr;
+	}
+
+	SetSegmentPointers(pSegment, pSegment->pHeader->particleCount);
+	return S_OK;
+}
+
+static void GetShardRange(UINT count, UINT shardCount, UINT shard, UINT* pFirst, UINT* pLast)
+{
+	*pFirst = UINT(ULONGLONG(count) * shard / shardCount);
+	*pLast = UINT(ULONGLONG(count) * (shard + 1) / shardCount);
+}
+
+static HRESULT StartShardWorker(LPCSTR pExePath, LPCSTR pNameOrPath, bool bFileBacked, UINT shard, UINT attempt,
+                                ShardFault fault, PROCESS_INFORMATION* pProcessOut)
+{
+	char cmdLine[3 * MAX_PATH];
+	sprintf_s(cmdLine, "\"%s\" %s %s \"%s\" %u %u %d", pExePath, SHARD_WORKER_SWITCH, bFileBacked ? "file" : "mem",
+		pNameOrPath, shard, attempt, int(fault));
+
+	STARTUPINFOA startupInfo = {};
+	startupInfo.cb = sizeof(startupInfo);
+
+	if (!CreateProcessA(pExePath, cmdLine, nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startupInfo, pProcessOut)) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	CloseHandle(pProcessOut->hThread);
+	pProcessOut->hThread = nullptr;
+	return S_OK;
+}
+
+static void StopShardWorker(PROCESS_INFORMATION* pProcess)
+{
+	TerminateProcess(pProcess->hProcess, 1);
+	WaitForSingleObject(pProcess->hProcess, INFINITE);
+	CloseHandle(pProcess->hProcess);
+	pProcess->hProcess = nullptr;
+}
+
+HRESULT RunShardedShadows(const Particle* pProjected, UINT count, const ShardRunDesc* pDesc, float* pShadowsOut)
+{
+	if (!pProjected || !pShadowsOut || !pDesc || pDesc->shardCount == 0 || pDesc->shardCount > SHARD_MAX_COUNT) {
+		return E_INVALIDARG;
+	}
+
+	const UINT shardCount = pDesc->shardCount;
+	const LPCSTR pBackingPath = pDesc->pBackingPath;
+
+	char exePath[MAX_PATH];
+	if (!GetModuleFileNameA(nullptr, exePath, MAX_PATH)) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	static volatile LONG segmentCounter = 0;
+	char segmentName[MAX_PATH];
+	sprintf_s(segmentName, "Local\\SelfShadowingShards_%u_%d", GetCurrentProcessId(), InterlockedIncrement(&segmentCounter));
+
+	ShardSegment segment;
+	HRESULT hr = CreateSegment(segmentName, pBackingPath, count, &segment);
+	if (FAILED(hr)) {
+		printf("Shared segment create failure\n");
+		return hr;
+	}
+
+	segment.pHeader->magic = SHARD_SEGMENT_MAGIC;
+	segment.pHeader->particleCount = count;
+	segment.pHeader->shardCount = shardCount;
+	for (UINT shard = 0; shard < shardCount; ++shard) {
+		segment.pHeader->shardState[shard] = SHARD_PENDING;
+	}
+	memcpy(segment.pParticles, pProjected, SIZE_T(count) * sizeof(Particle));
+	if (pBackingPath) {
+		FlushViewOfFile(segment.pView, 0);
+	}
+
+	const bool bFileBacked = pBackingPath != nullptr;
+	const LPCSTR pNameOrPath = bFileBacked ? pBackingPath : segmentName;
+
+	PROCESS_INFORMATION workers[SHARD_MAX_COUNT] = {};
+	ULONGLONG startTicks[SHARD_MAX_COUNT] = {};
+	UINT attempts[SHARD_MAX_COUNT] = {};
+	UINT running = 0;
+
+	auto startShard = [&](UINT shard) {
+		const ShardFault fault = shard == pDesc->faultShard && attempts[shard] == 0 ? pDesc->fault : SHARD_FAULT_NONE;
+
+		InterlockedExchange(&segment.pHeader->shardState[shard], SHARD_PENDING);
+		startTicks[shard] = GetTickCount64();
+		hr = StartShardWorker(exePath, pNameOrPath, bFileBacked, shard, attempts[shard], fault, &workers[shard]);
+		running += SUCCEEDED(hr);
+	};
+
+	// The worker died or hung before finishing its range: the range is recomputed from scratch,
+	// so whatever it managed to write is simply overwritten
+	auto restartShard = [&](UINT shard, DWORD exitCode) {
+		if (++attempts[shard] >= SHARD_MAX_ATTEMPTS) {
+			printf("Shard %u failed %u times (last exit code %u), giving up\n", shard, attempts[shard], exitCode);
+			hr = E_FAIL;
+			return;
+		}
+
+		printf("Shard %u worker failed (exit code %u), restarting...", shard, exitCode);
+		startShard(shard);
+	};
+
+	for (UINT shard = 0; shard < shardCount && SUCCEEDED(hr); ++shard) {
+		startShard(shard);
+	}
+
+	while (running > 0 && SUCCEEDED(hr)) {
+		HANDLE handles[SHARD_MAX_COUNT];
+		UINT shards[SHARD_MAX_COUNT];
+		DWORD numHandles = 0;
+
+		const ULONGLONG now = GetTickCount64();
+		DWORD timeout = INFINITE;
+
+		for (UINT shard = 0; shard < shardCount; ++shard) {
+			if (workers[shard].hProcess) {
+				handles[numHandles] = workers[shard].hProcess;
+				shards[numHandles++] = shard;
+
+				if (pDesc->shardTimeoutMs != INFINITE) {
+					const ULONGLONG elapsed = now - startTicks[shard];
+					const DWORD remaining = elapsed < pDesc->shardTimeoutMs ? DWORD(pDesc->shardTimeoutMs - elapsed) : 0;
+					timeout = (std::min)(timeout, remaining);
+				}
+			}
+		}
+
+		const DWORD wait = WaitForMultipleObjects(numHandles, handles, FALSE, timeout);
+
+		if (wait == WAIT_TIMEOUT) {
+			const ULONGLONG expired = GetTickCount64();
+			for (DWORD i = 0; i < numHandles && SUCCEEDED(hr); ++i) {
+				const UINT shard = shards[i];
+				if (expired - startTicks[shard] >= pDesc->shardTimeoutMs) {
+					printf("Shard %u worker timed out...", shard);
+					StopShardWorker(&workers[shard]);
+					--running;
+					restartShard(shard, WAIT_TIMEOUT);
+				}
+			}
+			continue;
+		}
+
+		if (wait >= WAIT_OBJECT_0 + numHandles) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+			break;
+		}
+
+		const UINT shard = shards[wait - WAIT_OBJECT_0];
+		DWORD exitCode = 1;
+		GetExitCodeProcess(workers[shard].hProcess, &exitCode);
+		CloseHandle(workers[shard].hProcess);
+		workers[shard].hProcess = nullptr;
+		--running;
+
+		if (exitCode != 0 || segment.pHeader->shardState[shard] != SHARD_DONE) {
+			restartShard(shard, exitCode);
+		}
+	}
+
+	for (UINT shard = 0; shard < shardCount; ++shard) {
+		if (workers[shard].hProcess) {
+			StopShardWorker(&workers[shard]);
+		}
+	}
+
+	if (SUCCEEDED(hr)) {
+		memcpy(pShadowsOut, segment.pShadows, SIZE_T(count) * sizeof(float));
+	}
+
+	ReleaseSegment(&segment);
+	if (pBackingPath) {
+		DeleteFileA(pBackingPath);
+	}
+
+	return hr;
+}
+
+bool IsShardWorkerCommandLine(int argc, char* argv[])
+{
+	return argc > 1 && strcmp(argv[1], SHARD_WORKER_SWITCH) == 0;
+}
+
+int RunShardWorker(int argc, char* argv[])
+{
+	// <exe> --shard-worker mem|file <name or path> <shard> <attempt> <fault>
+	if (argc != 7) {
+		return 2;
+	}
+
+	const bool bFileBacked = strcmp(argv[2], "file") == 0;
+	const UINT shard = UINT(strtoul(argv[4], nullptr, 10));
+	const ShardFault fault = ShardFault(strtol(argv[6], nullptr, 10));
+
+	ShardSegment segment;
+	if (FAILED(OpenSegment(bFileBacked, argv[3], &segment))) {
+		return 3;
+	}
+
+	const UINT count = segment.pHeader->particleCount;
+	const UINT shardCount = segment.pHeader->shardCount;
+	if (shard >= shardCount) {
+		ReleaseSegment(&segment);
+		return 2;
+	}
+
+	UINT first, last;
+	GetShardRange(count, shardCount, shard, &first, &last);
+
+	// Workers of the same box share its hardware threads
+	const UINT numThreads = (std::max)(std::thread::hardware_concurrency() / shardCount, 1u);
+	if (FAILED(ComputeShadowsCPU(segment.pParticles, count, first, last, segment.pShadows, numThreads))) {
+		ReleaseSegment(&segment);
+		return 4;
+	}
+
+	if (bFileBacked) {
+		FlushViewOfFile(segment.pView, 0);
+	}
+
+	// Injected after the range is written, so a restarted worker has to overwrite it
+	// Not abort(): the CRT may show a message box or report the fault, so the worker would hang instead of dying
+	if (fault == SHARD_FAULT_CRASH) {
+		TerminateProcess(GetCurrentProcess(), 5);
+	}
+	if (fault == SHARD_FAULT_HANG) {
+		Sleep(INFINITE);
+	}
+
+	InterlockedExchange(&segment.pHeader->shardState[shard], SHARD_DONE);
+
+	ReleaseSegment(&segment);
+	return 0;
+}
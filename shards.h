@@ -0,0 +1,53 @@
+//--------------------------------------------------------------------------------------
+// File: shards.h
+//
+// Multi-process sharded evaluation of particle self shadowing
+//
+// The coordinator publishes the projected particles in a shared memory segment (or in a
+// file on a local path) and starts shardCount worker processes of the current executable.
+// Every worker computes a disjoint receiver range with the CPU engine and writes it into
+// the output span of the same segment. Crashed workers are restarted per shard.
+//--------------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include "particles.h"
+
+// Limited by WaitForMultipleObjects
+#define SHARD_MAX_COUNT 64
+
+// Number of times a shard is started before the whole run is considered failed
+#define SHARD_MAX_ATTEMPTS 3
+
+// Command line switch the workers are started with
+#define SHARD_WORKER_SWITCH "--shard-worker"
+
+// Faults a worker can be told to inject after writing its range, to exercise the restart path
+enum ShardFault {
+	SHARD_FAULT_NONE,
+	SHARD_FAULT_CRASH,
+	SHARD_FAULT_HANG,
+};
+
+struct ShardRunDesc {
+	UINT shardCount;
+
+	// nullptr uses a pagefile backed named shared memory segment
+	LPCSTR pBackingPath;
+
+	// A worker running longer than this is terminated and its shard restarted, INFINITE to wait forever
+	DWORD shardTimeoutMs;
+
+	// Injected into the first attempt of faultShard only, so the restarted worker succeeds
+	ShardFault fault;
+	UINT faultShard;
+};
+
+// The result is bitwise equal to ComputeShadowsCPU() over the whole particle set
+HRESULT RunShardedShadows(const Particle* pProjected, UINT count, const ShardRunDesc* pDesc, float* pShadowsOut);
+
+bool IsShardWorkerCommandLine(int argc, char* argv[]);
+
+// Entry point of a worker process, returns the process exit code
+int RunShardWorker(int argc, char* argv[]);